@@ -0,0 +1,1119 @@
+#include "archive_stream.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// Smallest chunk compressed independently by the parallel encoder; smaller
+// chunks cost too much ratio and per-member overhead
+#define MIN_CHUNK_SIZE (128 * 1024)
+
+// Bytes at the start of a gzip member and of a zstd frame
+static const unsigned char GZIP_MAGIC[] = {0x1f, 0x8b};
+static const unsigned char ZSTD_MAGIC[] = {0x28, 0xb5, 0x2f, 0xfd};
+
+// Seek tables follow the zstd seekable format: one entry per frame holding its
+// compressed and decompressed sizes, then a footer of the frame count, a
+// descriptor byte and a magic number. zstd archives keep the table in a
+// skippable frame; gzip archives keep it in the extra field of empty gzip
+// members, which every gzip decoder reads as nothing
+#define SEEK_ENTRY_SIZE 8
+#define SEEK_FOOTER_SIZE 9
+#define SEEKABLE_MAGIC 0x8F92EAB1u
+#define ZSTD_SKIPPABLE_MAGIC 0x184D2A5Eu
+#define ZSTD_SKIPPABLE_HEADER_SIZE 8
+// Entries per gzip index member, keeping its extra field under 64 KiB
+#define GZIP_INDEX_ENTRIES 8000
+// Fixed parts of a gzip index member: header, extra field length and subfield
+// header, then an empty final deflate block, the CRC-32 and the size of no data
+#define GZIP_INDEX_HEADER_SIZE 16
+#define GZIP_INDEX_TAIL_SIZE 10
+static const unsigned char GZIP_INDEX_HEADER[] = {0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 255};
+static const unsigned char GZIP_INDEX_TAIL[GZIP_INDEX_TAIL_SIZE] = {3, 0};
+
+static void put_le16(unsigned char *ptr, unsigned value) {
+    ptr[0] = value & 0xff;
+    ptr[1] = (value >> 8) & 0xff;
+}
+
+static void put_le32(unsigned char *ptr, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        ptr[i] = (value >> (8 * i)) & 0xff;
+    }
+}
+
+static uint32_t get_le32(const unsigned char *ptr) {
+    return ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((uint32_t) ptr[3] << 24);
+}
+
+int write_all(int fd, const void *buf, size_t len) {
+    const char *ptr = buf;
+    while (len > 0) {
+        ssize_t written = write(fd, ptr, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        ptr += written;
+        len -= written;
+    }
+    return 0;
+}
+
+/*
+ * Refills the compressed input buffer of 'stream' once it is used up
+ * Returns 0 on success (with in_eof set at end of file) or -1 on error
+ */
+static int fill_input(in_stream_t *stream) {
+    if (stream->in_pos < stream->in_len || stream->in_eof) {
+        return 0;
+    }
+    ssize_t bytes_read;
+    do {
+        bytes_read = read(stream->fd, stream->in_buf, stream->in_buf_size);
+    } while (bytes_read < 0 && errno == EINTR);
+    if (bytes_read < 0) {
+        return -1;
+    }
+    stream->in_pos = 0;
+    stream->in_len = bytes_read;
+    stream->in_eof = bytes_read == 0;
+    return 0;
+}
+
+// gzip encoder and decoder, built on zlib
+
+static int gzip_write(out_stream_t *stream, const void *buf, size_t len) {
+    z_stream *z = stream->state;
+    z->next_in = (Bytef *) buf;
+    z->avail_in = len;
+    while (z->avail_in > 0) {
+        if (deflate(z, Z_NO_FLUSH) == Z_STREAM_ERROR) {
+            return -1;
+        }
+        if (z->avail_out == 0) {
+            if (0 != write_all(stream->fd, stream->out_buf, stream->out_buf_size)) {
+                return -1;
+            }
+            z->next_out = (Bytef *) stream->out_buf;
+            z->avail_out = stream->out_buf_size;
+        }
+    }
+    return 0;
+}
+
+static int gzip_finish(out_stream_t *stream) {
+    z_stream *z = stream->state;
+    z->next_in = NULL;
+    z->avail_in = 0;
+    int ret;
+    do {
+        ret = deflate(z, Z_FINISH);
+        if (ret == Z_STREAM_ERROR) {
+            return -1;
+        }
+        size_t produced = stream->out_buf_size - z->avail_out;
+        if (0 != write_all(stream->fd, stream->out_buf, produced)) {
+            return -1;
+        }
+        z->next_out = (Bytef *) stream->out_buf;
+        z->avail_out = stream->out_buf_size;
+    } while (ret != Z_STREAM_END);
+    return 0;
+}
+
+static void gzip_destroy(out_stream_t *stream) {
+    deflateEnd(stream->state);
+    free(stream->state);
+}
+
+static const encoder_ops_t gzip_encoder = {gzip_write, gzip_finish, gzip_destroy};
+
+static int gzip_encoder_init(out_stream_t *stream, int level) {
+    z_stream *z = calloc(1, sizeof(z_stream));
+    if (z == NULL) {
+        return -1;
+    }
+    // 15 window bits, plus 16 to ask zlib for a gzip rather than zlib wrapper
+    if (deflateInit2(z, level == 0 ? Z_DEFAULT_COMPRESSION : level, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(z);
+        return -1;
+    }
+    z->next_out = (Bytef *) stream->out_buf;
+    z->avail_out = stream->out_buf_size;
+    stream->state = z;
+    stream->ops = &gzip_encoder;
+    return 0;
+}
+
+static ssize_t gzip_read(in_stream_t *stream, void *buf, size_t len) {
+    z_stream *z = stream->state;
+    z->next_out = buf;
+    z->avail_out = len;
+    while (z->avail_out > 0) {
+        if (0 != fill_input(stream)) {
+            return -1;
+        }
+        if (stream->in_pos == stream->in_len) {
+            if (!stream->at_boundary) {
+                fprintf(stderr, "Compressed archive is truncated\n");
+                errno = EIO;
+                return -1;
+            }
+            break;
+        }
+
+        z->next_in = (Bytef *) stream->in_buf + stream->in_pos;
+        z->avail_in = stream->in_len - stream->in_pos;
+        int ret = inflate(z, Z_NO_FLUSH);
+        stream->in_pos = stream->in_len - z->avail_in;
+        if (ret == Z_STREAM_END) {
+            // Archives may hold several gzip members back to back
+            inflateReset(z);
+            stream->at_boundary = 1;
+        } else if (ret == Z_OK || ret == Z_BUF_ERROR) {
+            stream->at_boundary = 0;
+        } else {
+            fprintf(stderr, "Failed to decompress archive: %s\n", z->msg ? z->msg : "bad data");
+            errno = EIO;
+            return -1;
+        }
+    }
+    return len - z->avail_out;
+}
+
+static int gzip_reset(in_stream_t *stream) {
+    return inflateReset(stream->state) == Z_OK ? 0 : -1;
+}
+
+static void gzip_decoder_destroy(in_stream_t *stream) {
+    inflateEnd(stream->state);
+    free(stream->state);
+}
+
+static const decoder_ops_t gzip_decoder = {gzip_read, gzip_reset, gzip_decoder_destroy};
+
+static int gzip_decoder_init(in_stream_t *stream) {
+    z_stream *z = calloc(1, sizeof(z_stream));
+    if (z == NULL) {
+        return -1;
+    }
+    if (inflateInit2(z, 15 + 16) != Z_OK) {
+        free(z);
+        return -1;
+    }
+    stream->state = z;
+    stream->ops = &gzip_decoder;
+    return 0;
+}
+
+#ifdef HAVE_ZSTD
+// zstd encoder and decoder, built on libzstd's streaming API
+
+static int zstd_compress(out_stream_t *stream, const void *buf, size_t len,
+                         ZSTD_EndDirective mode) {
+    ZSTD_inBuffer in = {buf, len, 0};
+    size_t remaining;
+    do {
+        ZSTD_outBuffer out = {stream->out_buf, stream->out_buf_size, 0};
+        remaining = ZSTD_compressStream2(stream->state, &out, &in, mode);
+        if (ZSTD_isError(remaining)) {
+            fprintf(stderr, "Failed to compress archive: %s\n", ZSTD_getErrorName(remaining));
+            return -1;
+        }
+        if (0 != write_all(stream->fd, stream->out_buf, out.pos)) {
+            return -1;
+        }
+    } while (mode == ZSTD_e_end ? remaining != 0 : in.pos < in.size);
+    return 0;
+}
+
+static int zstd_write(out_stream_t *stream, const void *buf, size_t len) {
+    return zstd_compress(stream, buf, len, ZSTD_e_continue);
+}
+
+static int zstd_finish(out_stream_t *stream) {
+    return zstd_compress(stream, NULL, 0, ZSTD_e_end);
+}
+
+static void zstd_destroy(out_stream_t *stream) {
+    ZSTD_freeCCtx(stream->state);
+}
+
+static const encoder_ops_t zstd_encoder = {zstd_write, zstd_finish, zstd_destroy};
+
+static int zstd_encoder_init(out_stream_t *stream, int level) {
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    if (cctx == NULL) {
+        return -1;
+    }
+    if (level != 0 && ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level))) {
+        ZSTD_freeCCtx(cctx);
+        return -1;
+    }
+    stream->state = cctx;
+    stream->ops = &zstd_encoder;
+    return 0;
+}
+
+static ssize_t zstd_read(in_stream_t *stream, void *buf, size_t len) {
+    ZSTD_outBuffer out = {buf, len, 0};
+    while (out.pos < out.size) {
+        if (0 != fill_input(stream)) {
+            return -1;
+        }
+        if (stream->in_pos == stream->in_len) {
+            if (!stream->at_boundary) {
+                fprintf(stderr, "Compressed archive is truncated\n");
+                errno = EIO;
+                return -1;
+            }
+            break;
+        }
+
+        ZSTD_inBuffer in = {stream->in_buf, stream->in_len, stream->in_pos};
+        size_t ret = ZSTD_decompressStream(stream->state, &out, &in);
+        stream->in_pos = in.pos;
+        if (ZSTD_isError(ret)) {
+            fprintf(stderr, "Failed to decompress archive: %s\n", ZSTD_getErrorName(ret));
+            errno = EIO;
+            return -1;
+        }
+        // A return of 0 means a frame just ended; the next call starts a new one
+        stream->at_boundary = ret == 0;
+    }
+    return out.pos;
+}
+
+static int zstd_reset(in_stream_t *stream) {
+    return ZSTD_isError(ZSTD_DCtx_reset(stream->state, ZSTD_reset_session_only)) ? -1 : 0;
+}
+
+static void zstd_decoder_destroy(in_stream_t *stream) {
+    ZSTD_freeDCtx(stream->state);
+}
+
+static const decoder_ops_t zstd_decoder = {zstd_read, zstd_reset, zstd_decoder_destroy};
+
+static int zstd_decoder_init(in_stream_t *stream) {
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    if (dctx == NULL) {
+        return -1;
+    }
+    stream->state = dctx;
+    stream->ops = &zstd_decoder;
+    return 0;
+}
+#endif    // HAVE_ZSTD
+
+// Parallel encoder: the tar stream is cut into chunks that worker threads
+// compress independently, each into a complete gzip member or zstd frame.
+// Members and frames may be concatenated, so writing the chunks out in order
+// gives a stream that any gzip or zstd decoder reads as a whole.
+
+typedef enum {
+    CHUNK_EMPTY,     // Being filled by the writer, or unused
+    CHUNK_FILLED,    // Waiting for a worker
+    CHUNK_BUSY,      // Being compressed
+    CHUNK_DONE,      // Compressed and waiting to be written out
+} chunk_state_t;
+
+typedef struct {
+    char *in;
+    size_t in_len;
+    char *out;
+    size_t out_len;
+    chunk_state_t state;
+} chunk_t;
+
+typedef struct {
+    compression_t compression;
+    int level;
+    // Ring of chunks; chunk number 'seq' lives in slot seq % num_chunks
+    chunk_t *chunks;
+    int num_chunks;
+    size_t chunk_size;
+    size_t out_capacity;
+    pthread_t *threads;
+    int num_threads;
+    // Guards everything below and the state of every chunk
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    // Next chunk to be filled, compressed and written, in stream order
+    size_t next_fill;
+    size_t next_compress;
+    size_t next_write;
+    int error;
+    int stopping;
+    // Compressed and decompressed size of every chunk written, for the seek
+    // table of a seekable archive
+    int seekable;
+    uint32_t *frame_sizes;
+    size_t num_frames;
+    size_t frames_capacity;
+} parallel_encoder_t;
+
+/*
+ * Compresses chunk 'chunk' as a standalone gzip member or zstd frame using
+ * the worker's own compressor, 'z' or 'cctx'
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int compress_chunk(parallel_encoder_t *encoder, chunk_t *chunk, z_stream *z,
+                          void *cctx) {
+    if (encoder->compression == COMPRESS_GZIP) {
+        if (deflateReset(z) != Z_OK) {
+            return -1;
+        }
+        z->next_in = (Bytef *) chunk->in;
+        z->avail_in = chunk->in_len;
+        z->next_out = (Bytef *) chunk->out;
+        z->avail_out = encoder->out_capacity;
+        if (deflate(z, Z_FINISH) != Z_STREAM_END) {
+            return -1;
+        }
+        chunk->out_len = encoder->out_capacity - z->avail_out;
+        return 0;
+    }
+#ifdef HAVE_ZSTD
+    size_t out_len = ZSTD_compressCCtx(cctx, chunk->out, encoder->out_capacity, chunk->in,
+                                       chunk->in_len, encoder->level);
+    if (ZSTD_isError(out_len)) {
+        return -1;
+    }
+    chunk->out_len = out_len;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/*
+ * Body of each compression thread: takes filled chunks in stream order and
+ * compresses them until the encoder is stopped
+ */
+static void *parallel_worker(void *arg) {
+    parallel_encoder_t *encoder = arg;
+    z_stream z = {0};
+    void *cctx = NULL;
+    int ready;
+    if (encoder->compression == COMPRESS_GZIP) {
+        ready = deflateInit2(&z, encoder->level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) ==
+                Z_OK;
+    } else {
+#ifdef HAVE_ZSTD
+        cctx = ZSTD_createCCtx();
+#endif
+        ready = cctx != NULL;
+    }
+
+    pthread_mutex_lock(&encoder->lock);
+    if (!ready) {
+        encoder->error = 1;
+        pthread_cond_broadcast(&encoder->cond);
+    }
+    while (ready && !encoder->error) {
+        if (encoder->next_compress == encoder->next_fill) {
+            if (encoder->stopping) {
+                break;
+            }
+            pthread_cond_wait(&encoder->cond, &encoder->lock);
+            continue;
+        }
+        chunk_t *chunk = &encoder->chunks[encoder->next_compress % encoder->num_chunks];
+        encoder->next_compress++;
+        chunk->state = CHUNK_BUSY;
+        pthread_mutex_unlock(&encoder->lock);
+
+        int result = compress_chunk(encoder, chunk, &z, cctx);
+
+        pthread_mutex_lock(&encoder->lock);
+        chunk->state = CHUNK_DONE;
+        if (result != 0) {
+            encoder->error = 1;
+        }
+        pthread_cond_broadcast(&encoder->cond);
+    }
+    pthread_mutex_unlock(&encoder->lock);
+
+    if (encoder->compression == COMPRESS_GZIP) {
+        deflateEnd(&z);
+    }
+#ifdef HAVE_ZSTD
+    ZSTD_freeCCtx(cctx);
+#endif
+    return NULL;
+}
+
+/*
+ * Writes the oldest chunk not yet written to the stream's fd, first waiting
+ * for it to be compressed if 'wait' is nonzero
+ * Returns 1 if a chunk was written, 0 if none was ready or -1 on error
+ */
+static int write_oldest_chunk(out_stream_t *stream, int wait) {
+    parallel_encoder_t *encoder = stream->state;
+    pthread_mutex_lock(&encoder->lock);
+    chunk_t *chunk = &encoder->chunks[encoder->next_write % encoder->num_chunks];
+    while (wait && !encoder->error && encoder->next_write < encoder->next_fill &&
+           chunk->state != CHUNK_DONE) {
+        pthread_cond_wait(&encoder->cond, &encoder->lock);
+    }
+    int error = encoder->error;
+    int ready = encoder->next_write < encoder->next_fill && chunk->state == CHUNK_DONE;
+    pthread_mutex_unlock(&encoder->lock);
+    if (error) {
+        fprintf(stderr, "Failed to compress archive\n");
+        return -1;
+    }
+    if (!ready) {
+        return 0;
+    }
+
+    // Only this thread moves chunks out of CHUNK_DONE, so no lock is needed here
+    if (0 != write_all(stream->fd, chunk->out, chunk->out_len)) {
+        return -1;
+    }
+    if (encoder->seekable) {
+        if (encoder->num_frames == encoder->frames_capacity) {
+            size_t capacity = encoder->frames_capacity == 0 ? 256 : encoder->frames_capacity * 2;
+            uint32_t *sizes = realloc(encoder->frame_sizes, 2 * capacity * sizeof(uint32_t));
+            if (sizes == NULL) {
+                return -1;
+            }
+            encoder->frame_sizes = sizes;
+            encoder->frames_capacity = capacity;
+        }
+        encoder->frame_sizes[2 * encoder->num_frames] = chunk->out_len;
+        encoder->frame_sizes[2 * encoder->num_frames + 1] = chunk->in_len;
+        encoder->num_frames++;
+    }
+    pthread_mutex_lock(&encoder->lock);
+    chunk->state = CHUNK_EMPTY;
+    chunk->in_len = 0;
+    encoder->next_write++;
+    pthread_mutex_unlock(&encoder->lock);
+    return 1;
+}
+
+/*
+ * Hands the chunk being filled to the workers, writes out any chunks that are
+ * already compressed, and waits until the next slot in the ring is free
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int submit_chunk(out_stream_t *stream) {
+    parallel_encoder_t *encoder = stream->state;
+    pthread_mutex_lock(&encoder->lock);
+    encoder->chunks[encoder->next_fill % encoder->num_chunks].state = CHUNK_FILLED;
+    encoder->next_fill++;
+    pthread_cond_broadcast(&encoder->cond);
+    pthread_mutex_unlock(&encoder->lock);
+
+    int result;
+    while ((result = write_oldest_chunk(stream, 0)) == 1) {
+    }
+    // next_write and next_fill are only changed by this thread
+    while (result == 0 && encoder->next_fill - encoder->next_write == encoder->num_chunks) {
+        result = write_oldest_chunk(stream, 1) < 0 ? -1 : 0;
+    }
+    return result;
+}
+
+static int parallel_write(out_stream_t *stream, const void *buf, size_t len) {
+    parallel_encoder_t *encoder = stream->state;
+    const char *ptr = buf;
+    while (len > 0) {
+        chunk_t *chunk = &encoder->chunks[encoder->next_fill % encoder->num_chunks];
+        size_t room = encoder->chunk_size - chunk->in_len;
+        size_t amount = len < room ? len : room;
+        memcpy(chunk->in + chunk->in_len, ptr, amount);
+        chunk->in_len += amount;
+        ptr += amount;
+        len -= amount;
+        if (chunk->in_len == encoder->chunk_size && 0 != submit_chunk(stream)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Writes the seek table of the frames recorded by 'encoder' after them: as a
+ * single skippable frame for zstd, or spread over as many empty gzip members
+ * as needed, the last holding the footer
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int write_seek_table(out_stream_t *stream, parallel_encoder_t *encoder) {
+    size_t table_size = encoder->num_frames * SEEK_ENTRY_SIZE + SEEK_FOOTER_SIZE;
+    unsigned char *table = malloc(table_size);
+    if (table == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < 2 * encoder->num_frames; i++) {
+        put_le32(table + 4 * i, encoder->frame_sizes[i]);
+    }
+    unsigned char *footer = table + encoder->num_frames * SEEK_ENTRY_SIZE;
+    put_le32(footer, encoder->num_frames);
+    footer[4] = 0;    // Descriptor: no per-frame checksums
+    put_le32(footer + 5, SEEKABLE_MAGIC);
+
+    int result = 0;
+    if (encoder->compression == COMPRESS_ZSTD) {
+        unsigned char header[ZSTD_SKIPPABLE_HEADER_SIZE];
+        put_le32(header, ZSTD_SKIPPABLE_MAGIC);
+        put_le32(header + 4, table_size);
+        result = write_all(stream->fd, header, sizeof(header));
+        if (result == 0) {
+            result = write_all(stream->fd, table, table_size);
+        }
+    } else {
+        size_t done = 0;
+        while (result == 0 && done < table_size) {
+            size_t piece = GZIP_INDEX_ENTRIES * SEEK_ENTRY_SIZE;
+            if (table_size - done < piece + SEEK_FOOTER_SIZE) {
+                piece = table_size - done;
+            }
+            unsigned char header[GZIP_INDEX_HEADER_SIZE];
+            memcpy(header, GZIP_INDEX_HEADER, sizeof(GZIP_INDEX_HEADER));
+            put_le16(header + 10, piece + 4);
+            header[12] = 'S';
+            header[13] = 'K';
+            put_le16(header + 14, piece);
+            result = write_all(stream->fd, header, sizeof(header));
+            if (result == 0) {
+                result = write_all(stream->fd, table + done, piece);
+            }
+            if (result == 0) {
+                result = write_all(stream->fd, GZIP_INDEX_TAIL, GZIP_INDEX_TAIL_SIZE);
+            }
+            done += piece;
+        }
+    }
+    free(table);
+    return result;
+}
+
+static int parallel_finish(out_stream_t *stream) {
+    parallel_encoder_t *encoder = stream->state;
+    chunk_t *chunk = &encoder->chunks[encoder->next_fill % encoder->num_chunks];
+    // An empty stream still needs one (empty) member or frame to be valid
+    if ((chunk->in_len > 0 || encoder->next_fill == 0) && 0 != submit_chunk(stream)) {
+        return -1;
+    }
+    while (encoder->next_write < encoder->next_fill) {
+        if (write_oldest_chunk(stream, 1) < 0) {
+            return -1;
+        }
+    }
+    if (encoder->seekable) {
+        return write_seek_table(stream, encoder);
+    }
+    return 0;
+}
+
+static void parallel_destroy(out_stream_t *stream) {
+    parallel_encoder_t *encoder = stream->state;
+    pthread_mutex_lock(&encoder->lock);
+    encoder->stopping = 1;
+    pthread_cond_broadcast(&encoder->cond);
+    pthread_mutex_unlock(&encoder->lock);
+    for (int i = 0; i < encoder->num_threads; i++) {
+        pthread_join(encoder->threads[i], NULL);
+    }
+
+    for (int i = 0; encoder->chunks != NULL && i < encoder->num_chunks; i++) {
+        free(encoder->chunks[i].in);
+        free(encoder->chunks[i].out);
+    }
+    free(encoder->chunks);
+    free(encoder->threads);
+    free(encoder->frame_sizes);
+    pthread_mutex_destroy(&encoder->lock);
+    pthread_cond_destroy(&encoder->cond);
+    free(encoder);
+}
+
+static const encoder_ops_t parallel_encoder = {parallel_write, parallel_finish,
+                                               parallel_destroy};
+
+/*
+ * Sets up the parallel encoder on 'stream' with 'num_threads' workers, each
+ * compressing chunks of 'chunk_size' bytes, recording the frames written for
+ * a seek table if 'seekable' is nonzero. On failure the encoder may be left
+ * partly set up, for the caller to destroy.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int parallel_encoder_init(out_stream_t *stream, int level, size_t chunk_size,
+                                 int num_threads, int seekable) {
+    parallel_encoder_t *encoder = calloc(1, sizeof(parallel_encoder_t));
+    if (encoder == NULL) {
+        return -1;
+    }
+    encoder->seekable = seekable;
+    encoder->compression = stream->compression;
+    encoder->level = level;
+    if (stream->compression == COMPRESS_GZIP && level == 0) {
+        encoder->level = Z_DEFAULT_COMPRESSION;
+    }
+    encoder->chunk_size = chunk_size < MIN_CHUNK_SIZE ? MIN_CHUNK_SIZE : chunk_size;
+    if (stream->compression == COMPRESS_GZIP) {
+        // The bound depends on the stream's settings, so ask a matching stream
+        z_stream z = {0};
+        if (deflateInit2(&z, encoder->level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) !=
+            Z_OK) {
+            free(encoder);
+            return -1;
+        }
+        encoder->out_capacity = deflateBound(&z, encoder->chunk_size);
+        deflateEnd(&z);
+    } else {
+#ifdef HAVE_ZSTD
+        encoder->out_capacity = ZSTD_compressBound(encoder->chunk_size);
+#endif
+    }
+    pthread_mutex_init(&encoder->lock, NULL);
+    pthread_cond_init(&encoder->cond, NULL);
+    stream->state = encoder;
+    stream->ops = &parallel_encoder;
+
+    // Two chunks per worker keep every worker busy while the writer catches up
+    encoder->num_chunks = 2 * num_threads;
+    encoder->chunks = calloc(encoder->num_chunks, sizeof(chunk_t));
+    encoder->threads = calloc(num_threads, sizeof(pthread_t));
+    if (encoder->chunks == NULL || encoder->threads == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < encoder->num_chunks; i++) {
+        encoder->chunks[i].in = malloc(encoder->chunk_size);
+        encoder->chunks[i].out = malloc(encoder->out_capacity);
+        if (encoder->chunks[i].in == NULL || encoder->chunks[i].out == NULL) {
+            return -1;
+        }
+    }
+    for (; encoder->num_threads < num_threads; encoder->num_threads++) {
+        if (0 != pthread_create(&encoder->threads[encoder->num_threads], NULL, parallel_worker,
+                                encoder)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+compression_t detect_compression(const unsigned char *magic, size_t len) {
+    if (len >= sizeof(GZIP_MAGIC) && memcmp(magic, GZIP_MAGIC, sizeof(GZIP_MAGIC)) == 0) {
+        return COMPRESS_GZIP;
+    }
+    if (len >= sizeof(ZSTD_MAGIC) && memcmp(magic, ZSTD_MAGIC, sizeof(ZSTD_MAGIC)) == 0) {
+        return COMPRESS_ZSTD;
+    }
+    return COMPRESS_NONE;
+}
+
+int out_stream_open(out_stream_t *stream, int fd, compression_t compression, int level,
+                    size_t buf_size, int num_threads, int seekable) {
+    memset(stream, 0, sizeof(out_stream_t));
+    stream->fd = fd;
+    stream->compression = compression;
+    if (compression == COMPRESS_NONE) {
+        return 0;
+    }
+#ifndef HAVE_ZSTD
+    if (compression == COMPRESS_ZSTD) {
+        fprintf(stderr, "minitar was built without zstd support\n");
+        errno = ENOTSUP;
+        return -1;
+    }
+#endif
+    if (compression == COMPRESS_GZIP && level > Z_BEST_COMPRESSION) {
+        fprintf(stderr, "gzip compression level must be between 1 and %d\n", Z_BEST_COMPRESSION);
+        return -1;
+    }
+
+    stream->out_buf_size = buf_size;
+    stream->out_buf = malloc(buf_size);
+    if (stream->out_buf == NULL) {
+        return -1;
+    }
+    int result = -1;
+    if (num_threads > 1 || seekable) {
+        result = parallel_encoder_init(stream, level, buf_size, num_threads, seekable);
+    } else if (compression == COMPRESS_GZIP) {
+        result = gzip_encoder_init(stream, level);
+    } else {
+#ifdef HAVE_ZSTD
+        result = zstd_encoder_init(stream, level);
+#endif
+    }
+    if (result != 0) {
+        out_stream_close(stream, 0);
+    }
+    return result;
+}
+
+int out_stream_write(out_stream_t *stream, const void *buf, size_t len) {
+    if (stream->ops == NULL) {
+        return write_all(stream->fd, buf, len);
+    }
+    return stream->ops->write(stream, buf, len);
+}
+
+int out_stream_close(out_stream_t *stream, int finish) {
+    int result = 0;
+    if (stream->ops != NULL) {
+        if (finish) {
+            result = stream->ops->finish(stream);
+        }
+        stream->ops->destroy(stream);
+        stream->ops = NULL;
+    }
+    free(stream->out_buf);
+    stream->out_buf = NULL;
+    return result;
+}
+
+/*
+ * Reads 'len' bytes at 'offset' of 'fd' into 'buf'
+ * Returns 0 on success or -1 if an error occurs or the file is too short
+ */
+static int pread_exact(int fd, void *buf, size_t len, off_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t bytes_read = pread(fd, (char *) buf + done, len - done, offset + done);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            return -1;
+        }
+        done += bytes_read;
+    }
+    return 0;
+}
+
+/*
+ * Locates the seek table at the end of the archive open as 'stream', if it
+ * has one, and reads it into a buffer of entries followed by the footer
+ * Returns the buffer (to be freed by the caller) and stores the number of
+ * frames in 'num_frames' and where the table begins in 'table_start', or
+ * returns NULL if there is no valid table
+ */
+static unsigned char *read_seek_table(in_stream_t *stream, size_t *num_frames,
+                                      off_t *table_start) {
+    struct stat stat_buf;
+    unsigned char tail[SEEK_FOOTER_SIZE + GZIP_INDEX_TAIL_SIZE];
+    if (fstat(stream->fd, &stat_buf) != 0 || stat_buf.st_size < (off_t) sizeof(tail)) {
+        return NULL;
+    }
+    off_t file_size = stat_buf.st_size;
+    if (pread_exact(stream->fd, tail, sizeof(tail), file_size - sizeof(tail)) != 0) {
+        return NULL;
+    }
+    // In gzip archives the footer is followed by the index member's tail
+    unsigned char *footer = tail + GZIP_INDEX_TAIL_SIZE;
+    if (stream->compression == COMPRESS_GZIP) {
+        footer = tail;
+        if (memcmp(tail + SEEK_FOOTER_SIZE, GZIP_INDEX_TAIL, GZIP_INDEX_TAIL_SIZE) != 0) {
+            return NULL;
+        }
+    }
+    if (get_le32(footer + 5) != SEEKABLE_MAGIC || footer[4] != 0) {
+        return NULL;
+    }
+    *num_frames = get_le32(footer);
+
+    size_t table_size = *num_frames * SEEK_ENTRY_SIZE + SEEK_FOOTER_SIZE;
+    size_t full_pieces = *num_frames / GZIP_INDEX_ENTRIES;
+    size_t stored_size = ZSTD_SKIPPABLE_HEADER_SIZE + table_size;
+    if (stream->compression == COMPRESS_GZIP) {
+        stored_size = table_size + (full_pieces + 1) * (GZIP_INDEX_HEADER_SIZE +
+                                                        GZIP_INDEX_TAIL_SIZE);
+    }
+    if (stored_size > file_size) {
+        return NULL;
+    }
+    *table_start = file_size - stored_size;
+    unsigned char *stored = malloc(stored_size);
+    if (stored == NULL || pread_exact(stream->fd, stored, stored_size, *table_start) != 0) {
+        free(stored);
+        return NULL;
+    }
+
+    // Check the framing and gather the table's pieces into one buffer
+    unsigned char *table = malloc(table_size);
+    int valid = table != NULL;
+    if (valid && stream->compression == COMPRESS_ZSTD) {
+        valid = get_le32(stored) == ZSTD_SKIPPABLE_MAGIC && get_le32(stored + 4) == table_size;
+        memcpy(table, stored + ZSTD_SKIPPABLE_HEADER_SIZE, table_size);
+    } else if (valid) {
+        unsigned char *ptr = stored;
+        size_t done = 0;
+        for (size_t i = 0; valid && i <= full_pieces; i++) {
+            size_t piece = i < full_pieces ? GZIP_INDEX_ENTRIES * SEEK_ENTRY_SIZE
+                                           : table_size - done;
+            valid = memcmp(ptr, GZIP_INDEX_HEADER, sizeof(GZIP_INDEX_HEADER)) == 0 &&
+                    ptr[14] + (ptr[15] << 8) == piece && ptr[12] == 'S' && ptr[13] == 'K';
+            memcpy(table + done, ptr + GZIP_INDEX_HEADER_SIZE, piece);
+            done += piece;
+            ptr += GZIP_INDEX_HEADER_SIZE + piece + GZIP_INDEX_TAIL_SIZE;
+        }
+    }
+    free(stored);
+    if (!valid) {
+        free(table);
+        return NULL;
+    }
+    return table;
+}
+
+/*
+ * Loads the frame table of a seekable archive into 'stream'. Archives without
+ * a table, or whose table does not match the data before it (for instance
+ * because more data was concatenated after it), are left to be read
+ * sequentially.
+ * Returns 0 on success or -1 if memory runs out
+ */
+static int load_frame_table(in_stream_t *stream) {
+    size_t num_frames;
+    off_t table_start;
+    unsigned char *table = read_seek_table(stream, &num_frames, &table_start);
+    if (table == NULL) {
+        return 0;
+    }
+
+    stream->frame_file_offsets = malloc((num_frames + 1) * sizeof(off_t));
+    stream->frame_tar_offsets = malloc((num_frames + 1) * sizeof(off_t));
+    if (stream->frame_file_offsets == NULL || stream->frame_tar_offsets == NULL) {
+        free(table);
+        return -1;
+    }
+    stream->frame_file_offsets[0] = 0;
+    stream->frame_tar_offsets[0] = 0;
+    for (size_t i = 0; i < num_frames; i++) {
+        const unsigned char *entry = table + i * SEEK_ENTRY_SIZE;
+        stream->frame_file_offsets[i + 1] = stream->frame_file_offsets[i] + get_le32(entry);
+        stream->frame_tar_offsets[i + 1] = stream->frame_tar_offsets[i] + get_le32(entry + 4);
+    }
+    free(table);
+    if (stream->frame_file_offsets[num_frames] == table_start) {
+        stream->num_frames = num_frames;
+    }
+    return 0;
+}
+
+/*
+ * Returns the index of the frame of seekable 'stream' holding tar offset
+ * 'offset', or num_frames if 'offset' is past the end of the data
+ */
+static size_t find_frame(const in_stream_t *stream, off_t offset) {
+    size_t low = 0;
+    size_t high = stream->num_frames;
+    // Invariant: frame_tar_offsets[low] <= offset, and offset < that of 'high'
+    // unless high == num_frames
+    if (offset >= stream->frame_tar_offsets[high]) {
+        return high;
+    }
+    while (high - low > 1) {
+        size_t mid = low + (high - low) / 2;
+        if (stream->frame_tar_offsets[mid] <= offset) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/*
+ * Restarts decoding of compressed 'stream' at byte 'file_offset' of the file,
+ * where a frame holding tar bytes from 'tar_offset' begins
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int restart_decoding(in_stream_t *stream, off_t file_offset, off_t tar_offset) {
+    if (lseek(stream->fd, file_offset, SEEK_SET) == -1 || stream->ops->reset(stream) != 0) {
+        return -1;
+    }
+    stream->in_pos = 0;
+    stream->in_len = 0;
+    stream->in_eof = 0;
+    stream->at_boundary = 1;
+    stream->pos = tar_offset;
+    return 0;
+}
+
+int in_stream_open(in_stream_t *stream, int fd, size_t buf_size) {
+    memset(stream, 0, sizeof(in_stream_t));
+    stream->fd = fd;
+    stream->at_boundary = 1;
+
+    unsigned char magic[4];
+    ssize_t magic_len = pread(fd, magic, sizeof(magic), 0);
+    if (magic_len < 0) {
+        return -1;
+    }
+    stream->compression = detect_compression(magic, magic_len);
+    if (stream->compression == COMPRESS_NONE) {
+        struct stat stat_buf;
+        if (fstat(fd, &stat_buf) == 0 && S_ISREG(stat_buf.st_mode) && stat_buf.st_size > 0) {
+            void *map = mmap(NULL, stat_buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            // Archives that cannot be mapped are simply read instead
+            if (map != MAP_FAILED) {
+                stream->map = map;
+                stream->map_size = stat_buf.st_size;
+                in_stream_advise(stream, 0);
+            }
+        }
+        return 0;
+    }
+
+    stream->in_buf_size = buf_size;
+    stream->in_buf = malloc(buf_size);
+    stream->skip_buf = malloc(buf_size);
+    if (stream->in_buf == NULL || stream->skip_buf == NULL) {
+        in_stream_close(stream);
+        return -1;
+    }
+    int result = -1;
+    if (stream->compression == COMPRESS_GZIP) {
+        result = gzip_decoder_init(stream);
+    } else {
+#ifdef HAVE_ZSTD
+        result = zstd_decoder_init(stream);
+#else
+        fprintf(stderr, "minitar was built without zstd support\n");
+        errno = ENOTSUP;
+#endif
+    }
+    if (result == 0) {
+        result = load_frame_table(stream);
+    }
+    if (result != 0) {
+        in_stream_close(stream);
+    }
+    return result;
+}
+
+ssize_t in_stream_read_view(in_stream_t *stream, size_t len, void *fallback,
+                            const void **view) {
+    if (stream->map == NULL) {
+        *view = fallback;
+        return in_stream_read(stream, fallback, len);
+    }
+    size_t available = stream->pos < stream->map_size ? stream->map_size - stream->pos : 0;
+    if (len > available) {
+        len = available;
+    }
+    *view = stream->map + stream->pos;
+    stream->pos += len;
+    return len;
+}
+
+void in_stream_advise(in_stream_t *stream, int random_access) {
+    if (stream->map != NULL) {
+        madvise((void *) stream->map, stream->map_size,
+                random_access ? MADV_RANDOM : MADV_SEQUENTIAL);
+    }
+}
+
+ssize_t in_stream_read(in_stream_t *stream, void *buf, size_t len) {
+    const void *view;
+    if (stream->map != NULL) {
+        ssize_t bytes_read = in_stream_read_view(stream, len, NULL, &view);
+        memcpy(buf, view, bytes_read);
+        return bytes_read;
+    }
+
+    ssize_t total = 0;
+    if (stream->ops == NULL) {
+        while (total < len) {
+            ssize_t bytes_read = read(stream->fd, (char *) buf + total, len - total);
+            if (bytes_read < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            if (bytes_read == 0) {
+                break;
+            }
+            total += bytes_read;
+        }
+    } else {
+        total = stream->ops->read(stream, buf, len);
+        if (total < 0) {
+            return -1;
+        }
+    }
+    stream->pos += total;
+    return total;
+}
+
+int in_stream_seek(in_stream_t *stream, off_t offset) {
+    if (stream->map != NULL) {
+        stream->pos = offset;
+        return offset > stream->map_size ? 1 : 0;
+    }
+    if (stream->ops == NULL) {
+        struct stat stat_buf;
+        if (lseek(stream->fd, offset, SEEK_SET) == -1 || fstat(stream->fd, &stat_buf) != 0) {
+            return -1;
+        }
+        stream->pos = offset;
+        return S_ISREG(stat_buf.st_mode) && offset > stat_buf.st_size ? 1 : 0;
+    }
+
+    if (stream->num_frames > 0) {
+        // Jump to the frame holding 'offset' unless already decoding it
+        size_t frame = find_frame(stream, offset);
+        off_t frame_start = stream->frame_tar_offsets[frame];
+        if ((offset < stream->pos || frame_start > stream->pos) &&
+            restart_decoding(stream, stream->frame_file_offsets[frame], frame_start) != 0) {
+            return -1;
+        }
+    } else if (offset < stream->pos && restart_decoding(stream, 0, 0) != 0) {
+        // Compressed data can only be decoded forward, so going back means starting over
+        return -1;
+    }
+    while (stream->pos < offset) {
+        size_t chunk = offset - stream->pos;
+        chunk = chunk < stream->in_buf_size ? chunk : stream->in_buf_size;
+        ssize_t bytes_read = in_stream_read(stream, stream->skip_buf, chunk);
+        if (bytes_read < 0) {
+            return -1;
+        } else if (bytes_read == 0) {
+            // Like lseek past the end of a file, leave later reads to find the end
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void in_stream_close(in_stream_t *stream) {
+    if (stream->map != NULL) {
+        munmap((void *) stream->map, stream->map_size);
+        stream->map = NULL;
+    }
+    if (stream->ops != NULL) {
+        stream->ops->destroy(stream);
+        stream->ops = NULL;
+    }
+    free(stream->in_buf);
+    free(stream->skip_buf);
+    free(stream->frame_file_offsets);
+    free(stream->frame_tar_offsets);
+    stream->in_buf = NULL;
+    stream->skip_buf = NULL;
+    stream->frame_file_offsets = NULL;
+    stream->frame_tar_offsets = NULL;
+    stream->num_frames = 0;
+}
@@ -0,0 +1,151 @@
+#ifndef _ARCHIVE_STREAM_H
+#define _ARCHIVE_STREAM_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Compression applied to the tar byte stream of an archive
+typedef enum {
+    COMPRESS_NONE,
+    COMPRESS_GZIP,
+    COMPRESS_ZSTD,
+} compression_t;
+
+typedef struct out_stream out_stream_t;
+typedef struct in_stream in_stream_t;
+
+// Operations implemented by each encoder plugged into an out_stream_t
+typedef struct {
+    // Compress all 'len' bytes of 'buf', writing out full output buffers
+    int (*write)(out_stream_t *stream, const void *buf, size_t len);
+    // Flush everything still buffered and end the compressed stream
+    int (*finish)(out_stream_t *stream);
+    // Free the encoder's state
+    void (*destroy)(out_stream_t *stream);
+} encoder_ops_t;
+
+// Operations implemented by each decoder plugged into an in_stream_t
+typedef struct {
+    // Decompress up to 'len' bytes into 'buf', returning the number produced
+    // (0 only at the end of the data) or -1 on error
+    ssize_t (*read)(in_stream_t *stream, void *buf, size_t len);
+    // Start decoding again from the beginning of the data
+    int (*reset)(in_stream_t *stream);
+    // Free the decoder's state
+    void (*destroy)(in_stream_t *stream);
+} decoder_ops_t;
+
+// Destination of an archive's bytes: written straight to 'fd', or passed
+// through an encoder first
+struct out_stream {
+    int fd;
+    compression_t compression;
+    // Encoder and its state, both NULL for COMPRESS_NONE
+    const encoder_ops_t *ops;
+    void *state;
+    // Buffer that compressed output is gathered in before being written
+    char *out_buf;
+    size_t out_buf_size;
+};
+
+// Source of an archive's tar bytes, decompressed if needed
+struct in_stream {
+    int fd;
+    compression_t compression;
+    // Decoder and its state, both NULL for COMPRESS_NONE
+    const decoder_ops_t *ops;
+    void *state;
+    // Compressed input read from 'fd' but not yet decoded
+    char *in_buf;
+    size_t in_buf_size;
+    size_t in_pos;
+    size_t in_len;
+    int in_eof;
+    // Nonzero between the end of one compressed member or frame and the start
+    // of the next, i.e. when running out of input is not an error
+    int at_boundary;
+    // Offset in the uncompressed tar stream of the next byte to be read
+    off_t pos;
+    // Scratch space for skipping forward through compressed data
+    char *skip_buf;
+    // Frame table of a seekable archive, or 0 frames if it has none. Frame i
+    // starts at byte frame_file_offsets[i] of the file and holds tar bytes
+    // from frame_tar_offsets[i]; both arrays have num_frames + 1 entries, the
+    // last marking the end of the compressed data
+    size_t num_frames;
+    off_t *frame_file_offsets;
+    off_t *frame_tar_offsets;
+    // Whole-file mapping of an uncompressed archive, or NULL if it is read
+    // with read() instead
+    const char *map;
+    size_t map_size;
+};
+
+// Write all 'len' bytes of 'buf' to 'fd', retrying after short writes
+// Returns 0 on success or -1 if an error occurs
+int write_all(int fd, const void *buf, size_t len);
+
+// Set up 'stream' to write to 'fd' with the given compression. 'level' is the
+// compressor's level (0 for its default) and 'buf_size' the size of the
+// compressed output buffer. With 'num_threads' above 1, the data is instead cut
+// into chunks of 'buf_size' bytes (at least 128 KiB) that are compressed on
+// that many threads into separate gzip members or zstd frames. If 'seekable'
+// is nonzero the data is always cut this way, and a table of the frames is
+// written at the end so that readers can jump straight to any frame
+// Returns 0 on success or -1 if an error occurs
+int out_stream_open(out_stream_t *stream, int fd, compression_t compression, int level,
+                    size_t buf_size, int num_threads, int seekable);
+
+// Write all 'len' bytes of 'buf' to the stream
+// Returns 0 on success or -1 if an error occurs
+int out_stream_write(out_stream_t *stream, const void *buf, size_t len);
+
+// End the compressed stream, if any, and free the stream's memory. Does not
+// close the stream's fd. If 'finish' is 0 the stream is only freed, e.g. after
+// an earlier error
+// Returns 0 on success or -1 if an error occurs
+int out_stream_close(out_stream_t *stream, int finish);
+
+// Set up 'stream' to read from 'fd', which must be positioned at the start of
+// the archive. Compression is detected from the archive's magic bytes, and
+// 'buf_size' sets the size of the compressed input buffer. The frame table of
+// a seekable archive is loaded if present. Uncompressed archives in regular
+// files are mapped into memory for sequential access; the position of 'fd'
+// is then left alone by reads and seeks on the stream
+// Returns 0 on success or -1 if an error occurs
+int in_stream_open(in_stream_t *stream, int fd, size_t buf_size);
+
+// Read up to 'len' uncompressed bytes into 'buf'
+// Returns the number of bytes read, which is less than 'len' only at the end
+// of the archive, or -1 if an error occurs
+ssize_t in_stream_read(in_stream_t *stream, void *buf, size_t len);
+
+// Read up to 'len' uncompressed bytes without copying them when possible:
+// '*view' is pointed straight into the mapping of a mapped archive, or else at
+// 'fallback' (which must hold 'len' bytes) after reading into it. The view
+// stays valid until the stream is closed or, for 'fallback', reused
+// Returns the number of bytes in the view, which is less than 'len' only at
+// the end of the archive, or -1 if an error occurs
+ssize_t in_stream_read_view(in_stream_t *stream, size_t len, void *fallback,
+                            const void **view);
+
+// Tell the kernel how a mapped archive will be accessed: front to back, or
+// (if 'random_access' is nonzero) at scattered offsets found through an index
+void in_stream_advise(in_stream_t *stream, int random_access);
+
+// Move to 'offset' in the uncompressed tar stream. Uncompressed archives seek
+// directly; compressed ones decode and discard data to move forward, and
+// restart decoding from the beginning to move backward. Seekable archives
+// instead restart decoding at the frame holding 'offset' whenever that frame
+// is not the current one
+// Returns 0 on success, 1 if 'offset' is past the end of the archive (later
+// reads then find the end), or -1 if an error occurs
+int in_stream_seek(in_stream_t *stream, off_t offset);
+
+// Free the stream's memory. Does not close the stream's fd
+void in_stream_close(in_stream_t *stream);
+
+// Detect the compression of the data beginning with the 'len' bytes in 'magic'
+compression_t detect_compression(const unsigned char *magic, size_t len);
+
+#endif    // _ARCHIVE_STREAM_H
@@ -0,0 +1,96 @@
+#include "checksum.h"
+#include "octal.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+/*
+ * Every kernel returns the unsigned sum of all 512 bytes of a header block
+ * and stores in 'high_bytes' how many of them are 128 or above; each of
+ * those contributes 256 less to a signed sum.
+ */
+typedef unsigned (*sum_kernel_t)(const unsigned char *block, unsigned *high_bytes);
+
+static unsigned sum_block_generic(const unsigned char *block, unsigned *high_bytes) {
+    unsigned sum = 0;
+    unsigned high = 0;
+    for (int i = 0; i < HEADER_BLOCK_SIZE; i++) {
+        sum += block[i];
+        high += block[i] >> 7;
+    }
+    *high_bytes = high;
+    return sum;
+}
+
+#ifdef HAVE_X86_KERNELS
+// psadbw against zero adds up each group of 8 bytes into a 64-bit lane, and
+// pmovmskb collects the top bit of every byte
+__attribute__((target("sse2"))) static unsigned sum_block_sse2(const unsigned char *block,
+                                                                unsigned *high_bytes) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    unsigned high = 0;
+    for (int i = 0; i < HEADER_BLOCK_SIZE; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *) (block + i));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(bytes, zero));
+        high += __builtin_popcount(_mm_movemask_epi8(bytes));
+    }
+    *high_bytes = high;
+    return _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(acc, acc));
+}
+
+__attribute__((target("avx2"))) static unsigned sum_block_avx2(const unsigned char *block,
+                                                                unsigned *high_bytes) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+    unsigned high = 0;
+    for (int i = 0; i < HEADER_BLOCK_SIZE; i += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *) (block + i));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(bytes, zero));
+        high += __builtin_popcount(_mm256_movemask_epi8(bytes));
+    }
+    *high_bytes = high;
+    __m128i half = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    return _mm_cvtsi128_si32(half) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(half, half));
+}
+#endif
+
+static sum_kernel_t sum_block = sum_block_generic;
+
+// Runs before main, so the kernel never changes once threads exist
+__attribute__((constructor)) static void select_sum_kernel(void) {
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        sum_block = sum_block_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        sum_block = sum_block_sse2;
+    }
+#endif
+}
+
+unsigned header_checksum(const void *block, int *signed_sum) {
+    const unsigned char *bytes = block;
+    unsigned high;
+    unsigned sum = sum_block(bytes, &high);
+
+    // Swap the checksum field's contents for the spaces it is summed as
+    for (int i = CHKSUM_OFFSET; i < CHKSUM_OFFSET + CHKSUM_LEN; i++) {
+        sum += ' ' - bytes[i];
+        high -= bytes[i] >> 7;
+    }
+    if (signed_sum != NULL) {
+        *signed_sum = (int) sum - 256 * (int) high;
+    }
+    return sum;
+}
+
+void format_checksum(char field[CHKSUM_LEN], unsigned sum) {
+    // The largest possible sum, 512 * 255, always fits in seven octal digits
+    encode_numeric(field, CHKSUM_LEN, sum);
+}
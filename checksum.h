@@ -0,0 +1,25 @@
+#ifndef _CHECKSUM_H
+#define _CHECKSUM_H
+
+// Size of a tar header block
+#define HEADER_BLOCK_SIZE 512
+// Position and width of the checksum field within a header block
+#define CHKSUM_OFFSET 148
+#define CHKSUM_LEN 8
+
+/*
+ * Sums the bytes of the header block 'block' as POSIX specifies for its
+ * checksum: as unsigned values, with the checksum field itself counted as
+ * eight spaces. If 'signed_sum' is not NULL, also stores there the sum that
+ * older tars compute by treating the bytes as signed. The summing kernel
+ * (AVX2, SSE2 or plain C) is picked once at startup for the running CPU.
+ */
+unsigned header_checksum(const void *block, int *signed_sum);
+
+/*
+ * Writes 'sum' to the checksum field 'field' as seven 0-padded octal digits
+ * followed by a null byte, the same text as "%07o"
+ */
+void format_checksum(char field[CHKSUM_LEN], unsigned sum);
+
+#endif    // _CHECKSUM_H
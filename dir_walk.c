@@ -0,0 +1,471 @@
+#define _GNU_SOURCE
+#include "dir_walk.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Layout of each record returned by getdents64
+typedef struct {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} linux_dirent64_t;
+
+typedef struct walk_dir walk_dir_t;
+
+// One entry of a listed directory
+typedef struct {
+    // Null-terminated name of the entry in its directory's 'names', found by
+    // 'name_offset' while the listing is still growing
+    const char *name;
+    size_t name_offset;
+    // Listing of the entry if it is a directory, or NULL for a regular file
+    walk_dir_t *dir;
+    int is_dir;
+} walk_entry_t;
+
+// A directory found by the walk, and once listed, its sorted entries
+struct walk_dir {
+    // Path of the directory, ending in '/'
+    char *path;
+    // Descriptor opened relative to the parent directory, or -1 if the
+    // directory is to be opened by path
+    int fd;
+    walk_entry_t *entries;
+    size_t count;
+    size_t capacity;
+    char *names;
+    size_t names_size;
+    size_t names_capacity;
+};
+
+// State shared by the threads listing directories
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    // Directories waiting to be listed
+    walk_dir_t **stack;
+    size_t stack_size;
+    size_t stack_capacity;
+    // Directories waiting or being listed; the walk is done when this is 0
+    size_t pending;
+    // Descriptors held by directories that are waiting to be listed, and the
+    // most that may be held at once
+    int open_dirs;
+    int max_open_dirs;
+    int failed;
+} walk_t;
+
+/*
+ * Allocates a directory whose path is the 'len' bytes at 'path', which must
+ * end in '/', to be read from 'fd'
+ * Returns the new directory, or NULL if an error occurs
+ */
+static walk_dir_t *new_dir(const char *path, size_t len, int fd) {
+    walk_dir_t *dir = calloc(1, sizeof(walk_dir_t));
+    if (NULL == dir || NULL == (dir->path = malloc(len + 1))) {
+        free(dir);
+        return NULL;
+    }
+    memcpy(dir->path, path, len);
+    dir->path[len] = '\0';
+    dir->fd = fd;
+    return dir;
+}
+
+// Frees 'dir' and everything listed beneath it, closing any open descriptors
+static void free_dir(walk_dir_t *dir) {
+    if (NULL == dir) {
+        return;
+    }
+    for (size_t i = 0; i < dir->count; i++) {
+        free_dir(dir->entries[i].dir);
+    }
+    if (dir->fd != -1) {
+        close(dir->fd);
+    }
+    free(dir->entries);
+    free(dir->names);
+    free(dir->path);
+    free(dir);
+}
+
+/*
+ * Records the entry 'name' of 'dir', a directory if 'is_dir' is nonzero
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int add_entry(walk_dir_t *dir, const char *name, int is_dir) {
+    size_t len = strlen(name);
+    if (dir->count == dir->capacity) {
+        size_t capacity = dir->capacity == 0 ? 16 : dir->capacity * 2;
+        walk_entry_t *entries = realloc(dir->entries, capacity * sizeof(walk_entry_t));
+        if (NULL == entries) {
+            return -1;
+        }
+        dir->entries = entries;
+        dir->capacity = capacity;
+    }
+    if (dir->names_capacity - dir->names_size < len + 1) {
+        size_t capacity = dir->names_capacity == 0 ? 256 : dir->names_capacity * 2;
+        while (capacity - dir->names_size < len + 1) {
+            capacity *= 2;
+        }
+        char *names = realloc(dir->names, capacity);
+        if (NULL == names) {
+            return -1;
+        }
+        dir->names = names;
+        dir->names_capacity = capacity;
+    }
+    walk_entry_t *entry = &dir->entries[dir->count++];
+    entry->name = NULL;
+    entry->name_offset = dir->names_size;
+    entry->dir = NULL;
+    entry->is_dir = is_dir;
+    memcpy(dir->names + dir->names_size, name, len + 1);
+    dir->names_size += len + 1;
+    return 0;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    return strcmp(((const walk_entry_t *) a)->name, ((const walk_entry_t *) b)->name);
+}
+
+/*
+ * Reads every entry of 'dir' from the open directory 'fd' through 'dents', a
+ * buffer of WALK_DENTS_BUF_SIZE bytes, then sorts them by name. The type of
+ * each entry comes from getdents64 itself, or from an fstatat relative to
+ * 'fd' on filesystems that do not report it.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int read_entries(walk_dir_t *dir, int fd, char *dents) {
+    long nread;
+    while ((nread = syscall(SYS_getdents64, fd, dents, WALK_DENTS_BUF_SIZE)) != 0) {
+        if (nread < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        for (long pos = 0; pos < nread;) {
+            const linux_dirent64_t *dent = (const linux_dirent64_t *) (dents + pos);
+            pos += dent->d_reclen;
+            const char *name = dent->d_name;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+                continue;
+            }
+            unsigned char type = dent->d_type;
+            if (type == DT_UNKNOWN) {
+                struct stat stat_buf;
+                if (0 != fstatat(fd, name, &stat_buf, AT_SYMLINK_NOFOLLOW)) {
+                    return -1;
+                }
+                type = S_ISDIR(stat_buf.st_mode)   ? DT_DIR
+                       : S_ISREG(stat_buf.st_mode) ? DT_REG
+                                                   : DT_UNKNOWN;
+            }
+            if (type != DT_DIR && type != DT_REG) {
+                fprintf(stderr, "Skipping %s%s: not a regular file or directory\n", dir->path,
+                        name);
+                continue;
+            }
+            if (0 != add_entry(dir, name, type == DT_DIR)) {
+                return -1;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < dir->count; i++) {
+        dir->entries[i].name = dir->names + dir->entries[i].name_offset;
+    }
+    qsort(dir->entries, dir->count, sizeof(walk_entry_t), compare_entries);
+    return 0;
+}
+
+/*
+ * Lists 'dir' and queues its subdirectories on 'walk'. While the walk's
+ * limit of open directories allows, each subdirectory is opened here,
+ * relative to this one, so the kernel never walks its full path again.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int list_directory(walk_t *walk, walk_dir_t *dir, char *dents) {
+    char err_msg[PATH_MAX + 64];
+    int held = dir->fd != -1;
+    int fd = held ? dir->fd : open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    dir->fd = -1;
+    if (-1 == fd) {
+        snprintf(err_msg, sizeof(err_msg), "Failed to open directory %s", dir->path);
+        perror(err_msg);
+        return -1;
+    }
+
+    int result = read_entries(dir, fd, dents);
+    if (0 != result) {
+        snprintf(err_msg, sizeof(err_msg), "Failed to read directory %s", dir->path);
+        perror(err_msg);
+    }
+
+    // Set up the subdirectories, reserving descriptors for as many as allowed
+    size_t path_len = strlen(dir->path);
+    size_t num_dirs = 0;
+    for (size_t i = 0; i < dir->count && 0 == result; i++) {
+        num_dirs += dir->entries[i].is_dir;
+    }
+    pthread_mutex_lock(&walk->lock);
+    int allowed = walk->max_open_dirs - walk->open_dirs;
+    allowed = num_dirs < allowed ? num_dirs : allowed;
+    walk->open_dirs += allowed;
+    pthread_mutex_unlock(&walk->lock);
+
+    int opened = 0;
+    for (size_t i = 0; i < dir->count && 0 == result; i++) {
+        walk_entry_t *entry = &dir->entries[i];
+        if (!entry->is_dir) {
+            continue;
+        }
+        size_t name_len = strlen(entry->name);
+        char path[PATH_MAX];
+        if (path_len + name_len + 2 > PATH_MAX) {
+            fprintf(stderr, "Path %s%s is too long\n", dir->path, entry->name);
+            result = -1;
+            break;
+        }
+        memcpy(path, dir->path, path_len);
+        memcpy(path + path_len, entry->name, name_len);
+        path[path_len + name_len] = '/';
+
+        int child_fd = -1;
+        if (opened < allowed) {
+            child_fd = openat(fd, entry->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (-1 == child_fd) {
+                snprintf(err_msg, sizeof(err_msg), "Failed to open directory %s", path);
+                perror(err_msg);
+                result = -1;
+                break;
+            }
+            opened++;
+        }
+        entry->dir = new_dir(path, path_len + name_len + 1, child_fd);
+        if (NULL == entry->dir) {
+            perror("Failed to allocate directory listing");
+            if (-1 != child_fd) {
+                close(child_fd);
+                opened--;
+            }
+            result = -1;
+        }
+    }
+    close(fd);
+
+    // Queue the subdirectories in reverse, so they are popped in name order
+    pthread_mutex_lock(&walk->lock);
+    walk->open_dirs -= (allowed - opened) + held;
+    if (0 == result && walk->stack_capacity - walk->stack_size < num_dirs) {
+        size_t capacity = walk->stack_capacity == 0 ? 64 : walk->stack_capacity * 2;
+        while (capacity - walk->stack_size < num_dirs) {
+            capacity *= 2;
+        }
+        walk_dir_t **stack = realloc(walk->stack, capacity * sizeof(walk_dir_t *));
+        if (NULL == stack) {
+            perror("Failed to allocate directory queue");
+            result = -1;
+        } else {
+            walk->stack = stack;
+            walk->stack_capacity = capacity;
+        }
+    }
+    for (size_t i = dir->count; i > 0 && 0 == result; i--) {
+        if (dir->entries[i - 1].is_dir) {
+            walk->stack[walk->stack_size++] = dir->entries[i - 1].dir;
+            walk->pending++;
+        }
+    }
+    if (num_dirs > 0) {
+        pthread_cond_broadcast(&walk->work_ready);
+    }
+    pthread_mutex_unlock(&walk->lock);
+    return result;
+}
+
+/*
+ * Walker thread: lists queued directories until none are waiting or being
+ * listed by another thread, or until any thread fails
+ */
+static void *walk_worker(void *arg) {
+    walk_t *walk = arg;
+    char *dents = malloc(WALK_DENTS_BUF_SIZE);
+
+    pthread_mutex_lock(&walk->lock);
+    if (NULL == dents) {
+        perror("Failed to allocate directory buffer");
+        walk->failed = 1;
+    }
+    while (!walk->failed && walk->pending > 0) {
+        if (walk->stack_size == 0) {
+            pthread_cond_wait(&walk->work_ready, &walk->lock);
+            continue;
+        }
+        walk_dir_t *dir = walk->stack[--walk->stack_size];
+        pthread_mutex_unlock(&walk->lock);
+
+        int result = list_directory(walk, dir, dents);
+
+        pthread_mutex_lock(&walk->lock);
+        if (0 != result) {
+            walk->failed = 1;
+        }
+        walk->pending--;
+    }
+    // Wake the others to notice the walk is over
+    pthread_cond_broadcast(&walk->work_ready);
+    pthread_mutex_unlock(&walk->lock);
+    free(dents);
+    return NULL;
+}
+
+/*
+ * Adds the path of 'dir' and then, depth first, the paths of everything
+ * listed beneath it to 'out'
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int emit_dir(const walk_dir_t *dir, file_list_t *out) {
+    if (0 != file_list_add(out, dir->path)) {
+        perror("Failed to add name to file list");
+        return -1;
+    }
+    size_t path_len = strlen(dir->path);
+    for (size_t i = 0; i < dir->count; i++) {
+        const walk_entry_t *entry = &dir->entries[i];
+        if (entry->is_dir) {
+            if (0 != emit_dir(entry->dir, out)) {
+                return -1;
+            }
+            continue;
+        }
+        // Longer paths could not be opened to be archived anyway
+        size_t name_len = strlen(entry->name);
+        char path[PATH_MAX];
+        if (path_len + name_len + 1 > PATH_MAX) {
+            fprintf(stderr, "Path %s%s is too long\n", dir->path, entry->name);
+            return -1;
+        }
+        memcpy(path, dir->path, path_len);
+        memcpy(path + path_len, entry->name, name_len + 1);
+        if (0 != file_list_add(out, path)) {
+            perror("Failed to add name to file list");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int dir_walk_expand(const file_list_t *names, int num_threads, file_list_t *out, int *starts) {
+    walk_dir_t **roots = calloc(names->size + 1, sizeof(walk_dir_t *));
+    walk_t walk = {0};
+    if (NULL == roots ||
+        NULL == (walk.stack = malloc((names->size + 1) * sizeof(walk_dir_t *)))) {
+        perror("Failed to allocate directory walk");
+        free(roots);
+        return -1;
+    }
+    walk.stack_capacity = names->size + 1;
+    // Leave most descriptors to the rest of the process
+    struct rlimit limit;
+    walk.max_open_dirs = WALK_MAX_OPEN_DIRS;
+    if (0 == getrlimit(RLIMIT_NOFILE, &limit) && limit.rlim_cur / 4 < WALK_MAX_OPEN_DIRS) {
+        walk.max_open_dirs = limit.rlim_cur / 4;
+    }
+    pthread_mutex_init(&walk.lock, NULL);
+    pthread_cond_init(&walk.work_ready, NULL);
+
+    // Named directories are followed even through symbolic links; the walk
+    // starts from each of them, in reverse so the first is listed first
+    int result = 0;
+    for (int i = names->size - 1; i >= 0 && 0 == result; i--) {
+        const char *name = names->entries[i].name;
+        struct stat stat_buf;
+        if (0 != stat(name, &stat_buf) || !S_ISDIR(stat_buf.st_mode)) {
+            continue;
+        }
+        char path[PATH_MAX];
+        size_t len = names->entries[i].len;
+        while (len > 1 && name[len - 1] == '/') {
+            len--;
+        }
+        if (len + 2 > PATH_MAX) {
+            fprintf(stderr, "Path %s is too long\n", name);
+            result = -1;
+            break;
+        }
+        memcpy(path, name, len);
+        if (path[len - 1] != '/') {
+            path[len++] = '/';
+        }
+        roots[i] = new_dir(path, len, -1);
+        if (NULL == roots[i]) {
+            perror("Failed to allocate directory listing");
+            result = -1;
+            break;
+        }
+        walk.stack[walk.stack_size++] = roots[i];
+        walk.pending++;
+    }
+
+    // The calling thread lists directories too, alongside any extra threads
+    pthread_t *threads = NULL;
+    int num_started = 0;
+    if (0 == result && walk.pending > 0 && num_threads > 1) {
+        threads = calloc(num_threads - 1, sizeof(pthread_t));
+        for (int i = 0; NULL != threads && i < num_threads - 1; i++) {
+            if (0 != pthread_create(&threads[i], NULL, walk_worker, &walk)) {
+                break;
+            }
+            num_started++;
+        }
+    }
+    if (0 == result) {
+        walk_worker(&walk);
+    }
+    for (int i = 0; i < num_started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    if (walk.failed) {
+        result = -1;
+    }
+
+    // Only now is the order fixed: operands as given, directories depth first
+    for (int i = 0; i < names->size && 0 == result; i++) {
+        if (NULL != starts) {
+            starts[i] = out->size;
+        }
+        if (NULL != roots[i]) {
+            result = emit_dir(roots[i], out);
+        } else if (0 != file_list_add(out, names->entries[i].name)) {
+            perror("Failed to add name to file list");
+            result = -1;
+        }
+    }
+
+    for (int i = 0; i < names->size; i++) {
+        free_dir(roots[i]);
+    }
+    free(roots);
+    free(walk.stack);
+    pthread_mutex_destroy(&walk.lock);
+    pthread_cond_destroy(&walk.work_ready);
+    return result;
+}
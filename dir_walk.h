@@ -0,0 +1,29 @@
+#ifndef _DIR_WALK_H
+#define _DIR_WALK_H
+
+#include "file_list.h"
+
+// Most directories the walk keeps open at once waiting to be listed (fewer
+// if the descriptor limit is low); past that, in very wide trees,
+// directories are opened by path instead
+#define WALK_MAX_OPEN_DIRS 256
+
+// Bytes of directory entries fetched per getdents64 call
+#define WALK_DENTS_BUF_SIZE (64 * 1024)
+
+/*
+ * Adds every name in 'names' to 'out', in order. A name that refers to a
+ * directory is added with a trailing '/' and followed by everything beneath
+ * it, depth first with the entries of each directory sorted by name, so the
+ * same tree always gives the same list however the walk was scheduled.
+ * Beneath a named directory, only regular files and directories are added
+ * (symbolic links are not followed) and other entries are skipped with a
+ * warning. Directories are listed on 'num_threads' threads, each opened
+ * relative to its parent's descriptor and read with batched getdents64 calls.
+ * If 'starts' is not NULL, the position in 'out' of the first name added for
+ * each entry of 'names' is stored in it, one per entry.
+ * Returns 0 on success or -1 if an error occurs
+ */
+int dir_walk_expand(const file_list_t *names, int num_threads, file_list_t *out, int *starts);
+
+#endif    // _DIR_WALK_H
@@ -3,67 +3,171 @@
 #include <stdlib.h>
 #include <string.h>
 
+// Smallest number of hash slots allocated once the list is non-empty
+#define MIN_INDEX_SIZE 16
+// Usual size of a name arena chunk; longer names get a chunk of their own size
+#define NAME_CHUNK_SIZE (64 * 1024)
+
 void file_list_init(file_list_t *list) {
-    list->head = NULL;
+    list->entries = NULL;
     list->size = 0;
+    list->capacity = 0;
+    list->index = NULL;
+    list->index_size = 0;
+    list->num_indexed = 0;
+    list->chunks = NULL;
 }
 
-int file_list_add(file_list_t *list, const char *file_name) {
-    if (list->head == NULL) {
-        list->head = malloc(sizeof(node_t));
-        if (list->head == NULL) {
-            return 1;
+size_t file_list_hash(const char *file_name) {
+    size_t hash = 14695981039346656037ULL;
+    for (; *file_name != '\0'; file_name++) {
+        hash = (hash ^ (unsigned char) *file_name) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Copies 'len' bytes of 'file_name' plus a null byte into the list's arena
+// Returns the copy, or NULL if an error occurs
+static char *store_name(file_list_t *list, const char *file_name, size_t len) {
+    name_chunk_t *chunk = list->chunks;
+    if (chunk == NULL || chunk->capacity - chunk->used < len + 1) {
+        size_t capacity = len + 1 > NAME_CHUNK_SIZE ? len + 1 : NAME_CHUNK_SIZE;
+        chunk = malloc(sizeof(name_chunk_t) + capacity);
+        if (chunk == NULL) {
+            return NULL;
         }
-        strncpy(list->head->name, file_name, MAX_NAME_LEN);
-        list->head->next = NULL;
-        list->size = 1;
-        return 0;
+        chunk->next = list->chunks;
+        chunk->used = 0;
+        chunk->capacity = capacity;
+        list->chunks = chunk;
     }
+    char *copy = chunk->data + chunk->used;
+    memcpy(copy, file_name, len);
+    copy[len] = '\0';
+    chunk->used += len + 1;
+    return copy;
+}
 
-    node_t *current = list->head;
-    while (current->next != NULL) {
-        current = current->next;
+// Returns the slot in list's index holding the 'len'-byte name 'file_name',
+// or the empty slot where it would be inserted. The index must be allocated.
+static int find_slot(const file_list_t *list, const char *file_name, size_t len,
+                     size_t hash) {
+    int mask = list->index_size - 1;
+    int slot = hash & mask;
+    while (list->index[slot] != 0) {
+        const node_t *entry = &list->entries[list->index[slot] - 1];
+        if (entry->hash == hash && entry->len == len &&
+            memcmp(entry->name, file_name, len) == 0) {
+            return slot;
+        }
+        // Linear probing keeps collisions in the same cache lines
+        slot = (slot + 1) & mask;
     }
-    current->next = malloc(sizeof(node_t));
-    if (current->next == NULL) {
+    return slot;
+}
+
+// Doubles the number of hash slots and reinserts the first entry of each name
+// Returns 0 on success or 1 if an error occurs
+static int grow_index(file_list_t *list) {
+    int new_size = list->index_size == 0 ? MIN_INDEX_SIZE : list->index_size * 2;
+    int *new_index = calloc(new_size, sizeof(int));
+    if (new_index == NULL) {
         return 1;
     }
-    strncpy(current->next->name, file_name, MAX_NAME_LEN);
-    current->next->next = NULL;
-    list->size++;
+    free(list->index);
+    list->index = new_index;
+    list->index_size = new_size;
+
+    for (int i = 0; i < list->size; i++) {
+        const node_t *entry = &list->entries[i];
+        int slot = find_slot(list, entry->name, entry->len, entry->hash);
+        if (list->index[slot] == 0) {
+            list->index[slot] = i + 1;
+        }
+    }
     return 0;
 }
 
-int file_list_contains(const file_list_t *list, const char *file_name) {
-    node_t *current = list->head;
-    while (current != NULL) {
-        if (strcmp(current->name, file_name) == 0) {
+int file_list_add(file_list_t *list, const char *file_name) {
+    if (list->size == list->capacity) {
+        int new_capacity = list->capacity == 0 ? MIN_INDEX_SIZE : list->capacity * 2;
+        node_t *new_entries = realloc(list->entries, new_capacity * sizeof(node_t));
+        if (new_entries == NULL) {
             return 1;
         }
-        current = current->next;
+        list->entries = new_entries;
+        list->capacity = new_capacity;
+    }
+    // Keep the index at most half full so probe sequences stay short
+    if ((list->num_indexed + 1) * 2 > list->index_size && grow_index(list) != 0) {
+        return 1;
     }
+
+    node_t *entry = &list->entries[list->size];
+    entry->len = strlen(file_name);
+    entry->name = store_name(list, file_name, entry->len);
+    if (entry->name == NULL) {
+        return 1;
+    }
+    entry->hash = file_list_hash(entry->name);
+
+    int slot = find_slot(list, entry->name, entry->len, entry->hash);
+    if (list->index[slot] == 0) {
+        list->index[slot] = list->size + 1;
+        list->num_indexed++;
+    }
+    list->size++;
     return 0;
 }
 
+int file_list_contains(const file_list_t *list, const char *file_name) {
+    return file_list_find(list, file_name) != -1;
+}
+
+int file_list_find(const file_list_t *list, const char *file_name) {
+    if (list->index_size == 0) {
+        return -1;
+    }
+    int slot = find_slot(list, file_name, strlen(file_name), file_list_hash(file_name));
+    return list->index[slot] - 1;
+}
+
 int file_list_is_subset(const file_list_t *l1, const file_list_t *l2) {
-    // This approach is not particularly efficient
-    node_t *current = l1->head;
-    while (current != NULL) {
-        if (!file_list_contains(l2, current->name)) {
+    // More distinct names than l2 holds means at least one must be missing
+    if (l1->num_indexed > l2->num_indexed) {
+        return 0;
+    }
+    for (int i = 0; i < l1->size; i++) {
+        if (!file_list_contains(l2, l1->entries[i].name)) {
             return 0;
         }
-        current = current->next;
     }
     return 1;
 }
 
+int file_list_missing(const file_list_t *l1, const file_list_t *l2, file_list_t *missing) {
+    int num_missing = 0;
+    for (int i = 0; i < l1->size; i++) {
+        const char *name = l1->entries[i].name;
+        if (!file_list_contains(l2, name) && !file_list_contains(missing, name)) {
+            if (file_list_add(missing, name) != 0) {
+                return -1;
+            }
+            num_missing++;
+        }
+    }
+    return num_missing;
+}
+
 void file_list_clear(file_list_t *list) {
-    node_t *current = list->head;
-    while (current != NULL) {
-        node_t *to_free = current;
-        current = current->next;
+    // Names are freed a chunk at a time rather than one by one
+    name_chunk_t *chunk = list->chunks;
+    while (chunk != NULL) {
+        name_chunk_t *to_free = chunk;
+        chunk = chunk->next;
         free(to_free);
     }
-    list->head = NULL;
-    list->size = 0;
+    free(list->entries);
+    free(list->index);
+    file_list_init(list);
 }
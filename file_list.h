@@ -1,24 +1,47 @@
 #ifndef _FILE_LIST_H
 #define _FILE_LIST_H
 
-#define MAX_NAME_LEN 32
+#include <stddef.h>
 
-//  Definition of each node in the linked list
-typedef struct node {
-    char name[MAX_NAME_LEN];
-    struct node *next;
+// Block of memory that a list's names are bump-allocated from
+typedef struct name_chunk {
+    struct name_chunk *next;
+    size_t used;
+    size_t capacity;
+    char data[];
+} name_chunk_t;
+
+//  Definition of each entry in the list
+typedef struct {
+    // View of the name's bytes in the list's arena, null-terminated
+    const char *name;
+    // Length of name, not counting the null byte
+    size_t len;
+    // Cached file_list_hash of name, so growing the index never rehashes strings
+    size_t hash;
 } node_t;
 
-// Linked list definition
+// List definition: names are kept in insertion order in a contiguous array,
+// with an open-addressing hash index over them for fast lookup
 typedef struct {
-    node_t *head;
+    // Array of entries, 'size' of which are in use
+    node_t *entries;
     int size;
+    int capacity;
+    // Hash slots holding (entry index + 1) of the first entry with each name,
+    // or 0 if empty. 'index_size' is always 0 or a power of two
+    int *index;
+    int index_size;
+    // Number of occupied slots in 'index', i.e. distinct names in the list
+    int num_indexed;
+    // Arena holding the bytes of every name, newest chunk first
+    name_chunk_t *chunks;
 } file_list_t;
 
 // Initialize a new, empty list
 void file_list_init(file_list_t *list);
 
-// Add a new file name to the tail of the linked list
+// Add a copy of a new file name, of any length, to the tail of the list
 // Returns 0 on success or 1 if an error occurs
 int file_list_add(file_list_t *list, const char *file_name);
 
@@ -29,9 +52,22 @@ void file_list_clear(file_list_t *list);
 // Returns 1 if the name is present as an element in the list, 0 otherwise
 int file_list_contains(const file_list_t *list, const char *file_name);
 
+// Find the first entry of a list with the given name
+// Returns the entry's position in 'entries', or -1 if the name is not present
+int file_list_find(const file_list_t *list, const char *file_name);
+
 // Determine if the elements of l1 are a subset of the elements of l2
 // That is, all elements of l1 are contained in l2
+// Runs in O(n + m) time: one hash probe into l2 per element of l1
 // Returns 1 if l1 is a subset of l2, 0 otherwise
 int file_list_is_subset(const file_list_t *l1, const file_list_t *l2);
 
+// Add each distinct element of l1 that is not contained in l2 to 'missing',
+// in the order they appear in l1
+// Returns the number of names added to 'missing', or -1 if an error occurs
+int file_list_missing(const file_list_t *l1, const file_list_t *l2, file_list_t *missing);
+
+// Hash function used to index names (64-bit FNV-1a)
+size_t file_list_hash(const char *file_name);
+
 #endif    // _FILE_LIST_H
@@ -0,0 +1,153 @@
+#include "fingerprint.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+// XXH64's primes
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+// Loads little-endian words, as the hash is defined on them
+static uint64_t read64(const unsigned char *p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap64(value);
+#endif
+    return value;
+}
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap32(value);
+#endif
+    return value;
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * PRIME2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME1;
+}
+
+static uint64_t xxh_merge(uint64_t hash, uint64_t acc) {
+    hash ^= xxh_round(0, acc);
+    return hash * PRIME1 + PRIME4;
+}
+
+/*
+ * Feeds the whole 32-byte stripes at 'p' into the four accumulators, which
+ * are independent of each other so their rounds overlap in the pipeline
+ * Returns the number of bytes consumed
+ */
+static size_t consume_stripes(uint64_t acc[4], const unsigned char *p, size_t len) {
+    size_t done = 0;
+    uint64_t a0 = acc[0], a1 = acc[1], a2 = acc[2], a3 = acc[3];
+    for (; len - done >= 32; done += 32) {
+        a0 = xxh_round(a0, read64(p + done));
+        a1 = xxh_round(a1, read64(p + done + 8));
+        a2 = xxh_round(a2, read64(p + done + 16));
+        a3 = xxh_round(a3, read64(p + done + 24));
+    }
+    acc[0] = a0;
+    acc[1] = a1;
+    acc[2] = a2;
+    acc[3] = a3;
+    return done;
+}
+
+void fingerprint_init(fingerprint_t *state) {
+    memset(state, 0, sizeof(fingerprint_t));
+    state->acc[0] = PRIME1 + PRIME2;
+    state->acc[1] = PRIME2;
+    state->acc[2] = 0;
+    state->acc[3] = -PRIME1;
+}
+
+void fingerprint_update(fingerprint_t *state, const void *data, size_t len) {
+    const unsigned char *p = data;
+    state->total_len += len;
+
+    // Complete a stripe left over from the previous call first
+    if (state->pending_len > 0) {
+        size_t fill = 32 - state->pending_len < len ? 32 - state->pending_len : len;
+        memcpy(state->pending + state->pending_len, p, fill);
+        state->pending_len += fill;
+        p += fill;
+        len -= fill;
+        if (state->pending_len < 32) {
+            return;
+        }
+        consume_stripes(state->acc, state->pending, 32);
+        state->pending_len = 0;
+    }
+
+    size_t done = consume_stripes(state->acc, p, len);
+    memcpy(state->pending, p + done, len - done);
+    state->pending_len = len - done;
+}
+
+uint64_t fingerprint_digest(const fingerprint_t *state) {
+    uint64_t hash;
+    if (state->total_len >= 32) {
+        hash = rotl64(state->acc[0], 1) + rotl64(state->acc[1], 7) + rotl64(state->acc[2], 12) +
+               rotl64(state->acc[3], 18);
+        for (int i = 0; i < 4; i++) {
+            hash = xxh_merge(hash, state->acc[i]);
+        }
+    } else {
+        hash = PRIME5;
+    }
+    hash += state->total_len;
+
+    const unsigned char *p = state->pending;
+    size_t len = state->pending_len;
+    for (; len >= 8; p += 8, len -= 8) {
+        hash ^= xxh_round(0, read64(p));
+        hash = rotl64(hash, 27) * PRIME1 + PRIME4;
+    }
+    if (len >= 4) {
+        hash ^= (uint64_t) read32(p) * PRIME1;
+        hash = rotl64(hash, 23) * PRIME2 + PRIME3;
+        p += 4;
+        len -= 4;
+    }
+    for (; len > 0; p++, len--) {
+        hash ^= *p * PRIME5;
+        hash = rotl64(hash, 11) * PRIME1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= PRIME2;
+    hash ^= hash >> 29;
+    hash *= PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+int fingerprint_file(int fd, char *buf, size_t buf_size, uint64_t *hash) {
+    fingerprint_t state;
+    fingerprint_init(&state);
+    ssize_t bytes_read;
+    while ((bytes_read = read(fd, buf, buf_size)) != 0) {
+        if (bytes_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        fingerprint_update(&state, buf, bytes_read);
+    }
+    *hash = fingerprint_digest(&state);
+    return 0;
+}
@@ -0,0 +1,34 @@
+#ifndef _FINGERPRINT_H
+#define _FINGERPRINT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Streaming state for the XXH64 hash (seed 0) used to fingerprint member
+// contents. Data can be fed in pieces of any size.
+typedef struct {
+    uint64_t acc[4];
+    uint64_t total_len;
+    // Input not yet consumed by a full 32-byte stripe
+    unsigned char pending[32];
+    size_t pending_len;
+} fingerprint_t;
+
+// Starts a new, empty fingerprint in 'state'
+void fingerprint_init(fingerprint_t *state);
+
+// Adds 'len' bytes at 'data' to the fingerprint in 'state'
+void fingerprint_update(fingerprint_t *state, const void *data, size_t len);
+
+// Returns the fingerprint of everything added to 'state' so far
+uint64_t fingerprint_digest(const fingerprint_t *state);
+
+/*
+ * Fingerprints the rest of the file open as 'fd' from its current position,
+ * reading it through 'buf', which holds 'buf_size' bytes, and stores the
+ * result in 'hash'
+ * Returns 0 on success or -1 if an error occurs
+ */
+int fingerprint_file(int fd, char *buf, size_t buf_size, uint64_t *hash);
+
+#endif    // _FINGERPRINT_H
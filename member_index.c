@@ -0,0 +1,260 @@
+#include "archive_stream.h"
+#include "member_index.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Identifies index files, and their layout version
+static const char INDEX_MAGIC[8] = "MTIDX03";
+
+/*
+ * Hashes 'len' bytes of 'name' with 64-bit FNV-1a, the same function as
+ * file_list_hash but fixed at 64 bits since the result is stored on disk
+ */
+static uint64_t index_hash(const char *name, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char) name[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+int member_index_open(member_index_t *index, const char *index_name,
+                      const struct stat *archive_stat) {
+    memset(index, 0, sizeof(member_index_t));
+    int fd = open(index_name, O_RDONLY);
+    if (fd == -1) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    struct stat stat_buf;
+    if (fstat(fd, &stat_buf) != 0) {
+        close(fd);
+        return -1;
+    }
+    if (stat_buf.st_size < sizeof(index_header_t)) {
+        close(fd);
+        return 0;
+    }
+    void *map = mmap(NULL, stat_buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    // Lookups touch a few scattered pages rather than reading the file through
+    madvise(map, stat_buf.st_size, MADV_RANDOM);
+
+    // Each area is checked against the file size on its own before they are
+    // added up, so a damaged header cannot make the sum wrap around
+    const index_header_t *header = map;
+    uint64_t body_size = stat_buf.st_size - sizeof(index_header_t);
+    int sizes_fit = header->num_entries <= body_size / sizeof(index_entry_t) &&
+                    header->num_slots <= body_size / sizeof(uint32_t) &&
+                    header->names_size <= body_size;
+    int valid = sizes_fit && memcmp(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0 &&
+                header->num_slots > header->num_entries &&
+                (header->num_slots & (header->num_slots - 1)) == 0 &&
+                header->num_entries < UINT32_MAX &&
+                header->num_entries * sizeof(index_entry_t) +
+                        header->num_slots * sizeof(uint32_t) + header->names_size ==
+                    body_size &&
+                header->archive_size == archive_stat->st_size &&
+                header->archive_mtime_sec == archive_stat->st_mtim.tv_sec &&
+                header->archive_mtime_nsec == archive_stat->st_mtim.tv_nsec;
+    if (!valid) {
+        munmap(map, stat_buf.st_size);
+        return 0;
+    }
+
+    index->map = map;
+    index->map_size = stat_buf.st_size;
+    index->header = header;
+    index->entries = (const index_entry_t *) (header + 1);
+    index->slots = (const uint32_t *) (index->entries + header->num_entries);
+    index->names = (const char *) (index->slots + header->num_slots);
+    return 1;
+}
+
+void member_index_close(member_index_t *index) {
+    if (index->map != NULL) {
+        munmap(index->map, index->map_size);
+    }
+    memset(index, 0, sizeof(member_index_t));
+}
+
+const char *member_index_name(const member_index_t *index, const index_entry_t *entry) {
+    uint64_t end = (uint64_t) entry->name_offset + entry->name_len;
+    if (end >= index->header->names_size || index->names[end] != '\0') {
+        return NULL;
+    }
+    return index->names + entry->name_offset;
+}
+
+const index_entry_t *member_index_lookup(const member_index_t *index, const char *name) {
+    size_t len = strlen(name);
+    uint64_t mask = index->header->num_slots - 1;
+    uint64_t slot = index_hash(name, len) & mask;
+    // A well-formed index always has an empty slot to end the probe, but a
+    // damaged one might not, so at most every slot is visited once
+    for (uint64_t probes = 0; probes <= mask && index->slots[slot] != 0; probes++) {
+        uint32_t entry_index = index->slots[slot] - 1;
+        if (entry_index >= index->header->num_entries) {
+            return NULL;
+        }
+        const index_entry_t *entry = &index->entries[entry_index];
+        const char *entry_name = member_index_name(index, entry);
+        if (entry_name != NULL && entry->name_len == len && memcmp(entry_name, name, len) == 0) {
+            return entry;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return NULL;
+}
+
+int index_builder_add(index_builder_t *builder, const char *name, uint64_t header_offset,
+                      uint64_t size, int64_t mtime, uint32_t mode, char typeflag) {
+    size_t len = strlen(name);
+    if (builder->count == builder->capacity) {
+        size_t capacity = builder->capacity == 0 ? 64 : builder->capacity * 2;
+        index_entry_t *entries = realloc(builder->entries, capacity * sizeof(index_entry_t));
+        if (entries == NULL) {
+            return -1;
+        }
+        builder->entries = entries;
+        builder->capacity = capacity;
+    }
+    if (builder->names_capacity - builder->names_size < len + 1) {
+        size_t capacity = builder->names_capacity == 0 ? 4096 : builder->names_capacity * 2;
+        while (capacity - builder->names_size < len + 1) {
+            capacity *= 2;
+        }
+        char *names = realloc(builder->names, capacity);
+        if (names == NULL) {
+            return -1;
+        }
+        builder->names = names;
+        builder->names_capacity = capacity;
+    }
+    if (builder->names_size + len + 1 > UINT32_MAX) {
+        return -1;
+    }
+
+    index_entry_t *entry = &builder->entries[builder->count];
+    memset(entry, 0, sizeof(index_entry_t));
+    entry->header_offset = header_offset;
+    entry->size = size;
+    entry->mtime = mtime;
+    entry->name_offset = builder->names_size;
+    entry->name_len = len;
+    entry->mode = mode;
+    entry->typeflag = typeflag;
+    entry->racy = mtime >= builder->racy_from;
+    memcpy(builder->names + builder->names_size, name, len + 1);
+    builder->names_size += len + 1;
+    builder->count++;
+    return 0;
+}
+
+void index_builder_set_fingerprint(index_builder_t *builder, uint64_t fingerprint) {
+    index_entry_t *entry = &builder->entries[builder->count - 1];
+    entry->fingerprint = fingerprint;
+    entry->has_fingerprint = 1;
+}
+
+int index_builder_load(index_builder_t *builder, const member_index_t *index) {
+    for (uint64_t i = 0; i < index->header->num_entries; i++) {
+        const index_entry_t *entry = &index->entries[i];
+        const char *name = member_index_name(index, entry);
+        if (name == NULL || 0 != index_builder_add(builder, name, entry->header_offset,
+                                                   entry->size, entry->mtime, entry->mode,
+                                                   entry->typeflag)) {
+            return -1;
+        }
+        if (entry->has_fingerprint) {
+            index_builder_set_fingerprint(builder, entry->fingerprint);
+        }
+        builder->entries[builder->count - 1].racy = entry->racy;
+    }
+    return 0;
+}
+
+int index_builder_write(index_builder_t *builder, const char *index_name,
+                        const struct stat *archive_stat) {
+    // Keep the table at most half full so probe sequences stay short
+    uint64_t num_slots = 16;
+    while (num_slots < builder->count * 2) {
+        num_slots *= 2;
+    }
+    uint32_t *slots = calloc(num_slots, sizeof(uint32_t));
+    if (slots == NULL) {
+        return -1;
+    }
+    // One pass in archive order: each name's slot ends up at its latest version
+    for (size_t i = 0; i < builder->count; i++) {
+        index_entry_t *entry = &builder->entries[i];
+        const char *name = builder->names + entry->name_offset;
+        uint64_t slot = index_hash(name, entry->name_len) & (num_slots - 1);
+        entry->version = 1;
+        while (slots[slot] != 0) {
+            index_entry_t *other = &builder->entries[slots[slot] - 1];
+            if (other->name_len == entry->name_len &&
+                memcmp(builder->names + other->name_offset, name, entry->name_len) == 0) {
+                entry->version = other->version + 1;
+                other->latest = 0;
+                break;
+            }
+            slot = (slot + 1) & (num_slots - 1);
+        }
+        entry->latest = 1;
+        slots[slot] = i + 1;
+    }
+
+    index_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    header.archive_size = archive_stat->st_size;
+    header.archive_mtime_sec = archive_stat->st_mtim.tv_sec;
+    header.archive_mtime_nsec = archive_stat->st_mtim.tv_nsec;
+    header.num_entries = builder->count;
+    header.num_slots = num_slots;
+    header.names_size = builder->names_size;
+
+    // Write a temporary file and rename it over the old index, so readers
+    // never see a partly written one
+    char tmp_name[4096];
+    if (snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", index_name) >= sizeof(tmp_name)) {
+        free(slots);
+        return -1;
+    }
+    int fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        free(slots);
+        return -1;
+    }
+    int result = write_all(fd, &header, sizeof(header));
+    if (result == 0) {
+        result = write_all(fd, builder->entries, builder->count * sizeof(index_entry_t));
+    }
+    if (result == 0) {
+        result = write_all(fd, slots, num_slots * sizeof(uint32_t));
+    }
+    if (result == 0) {
+        result = write_all(fd, builder->names, builder->names_size);
+    }
+    free(slots);
+    if (close(fd) != 0 || result != 0 || rename(tmp_name, index_name) != 0) {
+        unlink(tmp_name);
+        return -1;
+    }
+    return 0;
+}
+
+void index_builder_clear(index_builder_t *builder) {
+    free(builder->entries);
+    free(builder->names);
+    memset(builder, 0, sizeof(index_builder_t));
+}
@@ -0,0 +1,127 @@
+#ifndef _MEMBER_INDEX_H
+#define _MEMBER_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+// Suffix appended to an archive's name to get the name of its index file
+#define INDEX_SUFFIX ".idx"
+
+// Index files start with this header, followed by 'num_entries' entries, then
+// 'num_slots' hash slots, then 'names_size' bytes of member names
+typedef struct {
+    char magic[8];
+    // Size and modification time of the archive when the index was written;
+    // an index whose archive no longer matches is ignored
+    uint64_t archive_size;
+    int64_t archive_mtime_sec;
+    int64_t archive_mtime_nsec;
+    uint64_t num_entries;
+    uint64_t num_slots;
+    uint64_t names_size;
+} index_header_t;
+
+// One member of the archive, in archive order
+typedef struct {
+    // Byte offset of the member's header in the (uncompressed) tar stream
+    uint64_t header_offset;
+    // Number of data bytes stored after the header
+    uint64_t size;
+    // Modification time from the header
+    int64_t mtime;
+    // Position and length (not counting its null byte) of the member's name
+    // in the names area
+    uint32_t name_offset;
+    uint32_t name_len;
+    // 1 for the first member with this name in the archive, 2 for the next...
+    uint32_t version;
+    // Permission bits from the header
+    uint32_t mode;
+    char typeflag;
+    // Nonzero if no later member in the archive has the same name
+    char latest;
+    // Nonzero if 'fingerprint' holds the hash of the member's data
+    char has_fingerprint;
+    // Nonzero if the file's mtime was not before the second its data was
+    // archived, so a later change within that second would not show in it
+    char racy;
+    char padding[4];
+    // XXH64 hash of the member's data, recorded with --fingerprint
+    uint64_t fingerprint;
+} index_entry_t;
+
+// A read-only index file mapped into memory
+typedef struct {
+    void *map;
+    size_t map_size;
+    const index_header_t *header;
+    const index_entry_t *entries;
+    // Open-addressing hash slots holding (entry index + 1) of the latest
+    // version of each name, or 0 if empty. The slot count is a power of two
+    const uint32_t *slots;
+    const char *names;
+} member_index_t;
+
+// Index being built in memory, one entry per member added
+typedef struct {
+    index_entry_t *entries;
+    size_t count;
+    size_t capacity;
+    char *names;
+    size_t names_size;
+    size_t names_capacity;
+    // Members added with an mtime at or after this second are marked racy
+    int64_t racy_from;
+} index_builder_t;
+
+/*
+ * Maps the index file 'index_name' into 'index' if it exists and was written
+ * for the archive as described by 'archive_stat'
+ * Returns 1 if the index was mapped, 0 if there is no usable index, or -1 if
+ * an error occurs
+ */
+int member_index_open(member_index_t *index, const char *index_name,
+                      const struct stat *archive_stat);
+
+// Unmaps 'index'
+void member_index_close(member_index_t *index);
+
+/*
+ * Returns the entry for the latest version of the member named 'name', or
+ * NULL if there is no such member. Costs one hash probe into the mapping.
+ */
+const index_entry_t *member_index_lookup(const member_index_t *index, const char *name);
+
+/*
+ * Returns the null-terminated name of 'entry', which points into the mapping,
+ * or NULL if the index file is damaged
+ */
+const char *member_index_name(const member_index_t *index, const index_entry_t *entry);
+
+// Records one member at the end of the index being built, marking it racy
+// if 'mtime' is not before the builder's 'racy_from'
+// Returns 0 on success or -1 if an error occurs
+int index_builder_add(index_builder_t *builder, const char *name, uint64_t header_offset,
+                      uint64_t size, int64_t mtime, uint32_t mode, char typeflag);
+
+// Records 'fingerprint' as the hash of the data of the last member added
+void index_builder_set_fingerprint(index_builder_t *builder, uint64_t fingerprint);
+
+// Adds every entry of the mapped 'index' to 'builder', in order
+// Returns 0 on success or -1 if an error occurs
+int index_builder_load(index_builder_t *builder, const member_index_t *index);
+
+/*
+ * Computes versions and the name hash for the members added to 'builder' and
+ * writes them as the index file 'index_name', recording 'archive_stat' as the
+ * state of the archive it describes. The file is replaced atomically.
+ * Returns 0 on success or -1 if an error occurs
+ */
+int index_builder_write(index_builder_t *builder, const char *index_name,
+                        const struct stat *archive_stat);
+
+// Frees all memory held by 'builder' and leaves it empty
+void index_builder_clear(index_builder_t *builder);
+
+#endif    // _MEMBER_INDEX_H
@@ -1,308 +1,3170 @@
+#define _GNU_SOURCE
+#include "checksum.h"
+#include "dir_walk.h"
+#include "fingerprint.h"
+#include "member_index.h"
 #include "minitar.h"
+#include "octal.h"
+#include "uring.h"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <grp.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #define NUM_TRAILING_BLOCKS 2
 #define MAX_MSG_LEN 128
+// linux/fs.h, pulled in by io_uring.h, has an unrelated BLOCK_SIZE of its own
+#undef BLOCK_SIZE
 #define BLOCK_SIZE 512
+// Member data buffers are aligned to this boundary so reads and writes stay page-aligned
+#define COPY_BUF_ALIGN 4096
+// Members handled per io_uring batch, and the staging buffer size in copy buffers
+#define URING_BATCH 64
+#define URING_STAGING_BUFS 8
 
 // Constants for tar compatibility information
 #define MAGIC "ustar"
 
 // Constants to represent different file types
-// We'll only use regular files in this project
+// Regular files and directories are archived
 #define REGTYPE '0'
 #define DIRTYPE '5'
 
+minitar_options_t minitar_options = {
+    .copy_buf_size = DEFAULT_COPY_BUF_SIZE,
+    .verbose = 0,
+    .numeric_owner = 0,
+    .num_threads = 1,
+    .use_io_uring = 0,
+    .compression = COMPRESS_NONE,
+    .compression_level = 0,
+    .seekable = 0,
+    .use_index = 0,
+    .fingerprint = 0,
+};
+
+// Number of distinct owners (and, separately, groups) remembered per run
+#define ID_CACHE_SIZE 16
+
+// Small cache of user or group names, keyed by numeric ID. Archives usually
+// have only a handful of owners, so a linear scan beats any fancier structure.
+typedef struct {
+    unsigned ids[ID_CACHE_SIZE];
+    char names[ID_CACHE_SIZE][32];
+    // Number of slots in use, and the slot to replace next once all are used
+    int count;
+    int next_victim;
+    size_t hits;
+    size_t misses;
+} id_cache_t;
+
+static id_cache_t uid_cache;
+static id_cache_t gid_cache;
+
+/*
+ * Returns the current value of a monotonic clock in seconds, used to time copies
+ */
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Longest member path a ustar header can hold: prefix, '/', name and a null byte
+#define MAX_MEMBER_NAME_LEN (155 + 1 + 100 + 1)
+
+// One member found while scanning the headers of an archive
+typedef struct {
+    // View of the member's header: inside the archive's mapping when it is
+    // mapped, or else 'header_buf'
+    const tar_header *header;
+    tar_header header_buf;
+    // Full member path, joined from the header's prefix and name fields
+    char name[MAX_MEMBER_NAME_LEN];
+    // Byte offset of the member's header block within the archive
+    off_t header_offset;
+    // Number of data bytes stored after the header
+    size_t size;
+} archive_member_t;
+
+// Header parsing, defined with the rest of the read side below
+static int is_zero_block(const char *block);
+static int read_archive_member(in_stream_t *archive, archive_member_t *member, int *cut_off);
+int next_archive_member(in_stream_t *archive, archive_member_t *member);
+void get_member_name(const tar_header *header, char name[MAX_MEMBER_NAME_LEN]);
+
+// Compact record of one member, kept for every member while extracting
+typedef struct {
+    // Full member path, heap-allocated
+    char *name;
+    // Byte offset of the member's header block within the archive
+    off_t header_offset;
+    // Number of data bytes stored after the header
+    size_t size;
+    // Permission bits and modification time from the header
+    mode_t mode;
+    time_t mtime;
+    char typeflag;
+    // Nonzero if no later member in the archive has the same name
+    int latest;
+} member_entry_t;
+
+// Growable array of member records, in archive order
+typedef struct {
+    member_entry_t *entries;
+    size_t count;
+    size_t capacity;
+} member_table_t;
+
+/*
+ * Allocates a buffer of at least 'size' bytes aligned to COPY_BUF_ALIGN
+ * Returns the buffer, or NULL if an error occurs
+ */
+char *alloc_copy_buffer(size_t size) {
+    size_t alloc_size = (size + COPY_BUF_ALIGN - 1) / COPY_BUF_ALIGN * COPY_BUF_ALIGN;
+    return aligned_alloc(COPY_BUF_ALIGN, alloc_size);
+}
+
 /*
  * Helper function to compute the checksum of a tar header block
  * Performs a simple sum over all bytes in the header in accordance with POSIX
- * standard for tar file structure.
+ * standard for tar file structure, i.e. of the bytes as unsigned values.
  */
 void compute_checksum(tar_header *header) {
-    // Have to initially set header's checksum to "all blanks"
-    memset(header->chksum, ' ', 8);
-    unsigned sum = 0;
-    char *bytes = (char *) header;
-    for (int i = 0; i < sizeof(tar_header); i++) {
-        sum += bytes[i];
-    }
-    snprintf(header->chksum, 8, "%07o", sum);
+    format_checksum(header->chksum, header_checksum(header, NULL));
 }
 
 /*
- * Populates a tar header block pointed to by 'header' with metadata about
- * the file identified by 'file_name'.
- * Returns 0 on success or -1 if an error occurs
+ * Returns nonzero if the checksum stored in 'header' matches its contents.
+ * Some tars sum the bytes as signed and others as unsigned, so either is
+ * accepted. Both sums come out of a single pass over the block.
  */
-int fill_tar_header(tar_header *header, const char *file_name) {
-    memset(header, 0, sizeof(tar_header));
-    char err_msg[MAX_MSG_LEN];
-    struct stat stat_buf;
-    // stat is a system call to inspect file metadata
-    if (stat(file_name, &stat_buf) != 0) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to stat file %s", file_name);
-        perror(err_msg);
+static int header_checksum_ok(const tar_header *header) {
+    int signed_sum;
+    unsigned sum = header_checksum(header, &signed_sum);
+    unsigned long long stored = decode_numeric(header->chksum, sizeof(header->chksum));
+    return stored == sum || stored == (unsigned) signed_sum;
+}
+
+/*
+ * Checks the header of 'member', which was just read from an archive
+ * Returns 0 if its checksum matches or -1, with a message, if it does not
+ */
+static int verify_member_header(const archive_member_t *member) {
+    if (!header_checksum_ok(member->header)) {
+        fprintf(stderr, "Archive header at offset %lld has a bad checksum\n",
+                (long long) member->header_offset);
         return -1;
     }
+    return 0;
+}
+
+/*
+ * Returns the cached name for 'id' in 'cache', or NULL if it is not cached
+ */
+static const char *id_cache_find(id_cache_t *cache, unsigned id) {
+    for (int i = 0; i < cache->count; i++) {
+        if (cache->ids[i] == id) {
+            cache->hits++;
+            return cache->names[i];
+        }
+    }
+    cache->misses++;
+    return NULL;
+}
 
-    strncpy(header->name, file_name, 100);    // Name of the file, null-terminated string
-    snprintf(header->mode, 8, "%07o",
-             stat_buf.st_mode & 07777);    // Permissions for file, 0-padded octal
+/*
+ * Remembers 'name' for 'id' in 'cache', evicting the oldest entry when full
+ * Returns the cached copy of the name
+ */
+static const char *id_cache_insert(id_cache_t *cache, unsigned id, const char *name) {
+    int slot;
+    if (cache->count < ID_CACHE_SIZE) {
+        slot = cache->count++;
+    } else {
+        slot = cache->next_victim;
+        cache->next_victim = (cache->next_victim + 1) % ID_CACHE_SIZE;
+    }
+    cache->ids[slot] = id;
+    strncpy(cache->names[slot], name, sizeof(cache->names[slot]));
+    return cache->names[slot];
+}
 
-    snprintf(header->uid, 8, "%07o", stat_buf.st_uid);    // Owner ID of the file, 0-padded octal
-    struct passwd *pwd = getpwuid(stat_buf.st_uid);       // Look up name corresponding to owner ID
-    if (pwd == NULL) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to look up owner name of file %s", file_name);
-        perror(err_msg);
-        return -1;
+/*
+ * Looks up the user name of 'uid', consulting the password database only the
+ * first time each ID is seen
+ * Returns the name (not necessarily null-terminated if it fills all 32 bytes),
+ * or NULL if the ID has no name
+ */
+const char *lookup_user_name(uid_t uid) {
+    const char *name = id_cache_find(&uid_cache, uid);
+    if (name == NULL) {
+        struct passwd *pwd = getpwuid(uid);
+        if (pwd != NULL) {
+            name = id_cache_insert(&uid_cache, uid, pwd->pw_name);
+        }
     }
-    strncpy(header->uname, pwd->pw_name, 32);    // Owner name of the file, null-terminated string
+    return name;
+}
 
-    snprintf(header->gid, 8, "%07o", stat_buf.st_gid);    // Group ID of the file, 0-padded octal
-    struct group *grp = getgrgid(stat_buf.st_gid);        // Look up name corresponding to group ID
-    if (grp == NULL) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to look up group name of file %s", file_name);
-        perror(err_msg);
-        return -1;
+/*
+ * Looks up the group name of 'gid', consulting the group database only the
+ * first time each ID is seen
+ * Returns the name (not necessarily null-terminated if it fills all 32 bytes),
+ * or NULL if the ID has no name
+ */
+const char *lookup_group_name(gid_t gid) {
+    const char *name = id_cache_find(&gid_cache, gid);
+    if (name == NULL) {
+        struct group *grp = getgrgid(gid);
+        if (grp != NULL) {
+            name = id_cache_insert(&gid_cache, gid, grp->gr_name);
+        }
     }
-    strncpy(header->gname, grp->gr_name, 32);    // Group name of the file, null-terminated string
+    return name;
+}
 
-    snprintf(header->size, 12, "%011o",
-             (unsigned) stat_buf.st_size);    // File size, 0-padded octal
-    snprintf(header->mtime, 12, "%011o",
-             (unsigned) stat_buf.st_mtime);    // Modification time, 0-padded octal
-    header->typeflag = REGTYPE;                // File type, always regular file in this project
-    strncpy(header->magic, MAGIC, 6);          // Special, standardized sequence of bytes
-    memcpy(header->version, "00", 2);          // A bit weird, sidesteps null termination
-    snprintf(header->devmajor, 8, "%07o",
-             major(stat_buf.st_dev));    // Major device number, 0-padded octal
-    snprintf(header->devminor, 8, "%07o",
-             minor(stat_buf.st_dev));    // Minor device number, 0-padded octal
+/*
+ * Stores 'file_name' in the name field of 'header', or splits it at a '/'
+ * between the prefix and name fields if it is longer than the name field
+ * Returns 0 on success or -1 if the name is too long for a ustar header
+ */
+int set_header_name(tar_header *header, const char *file_name) {
+    size_t len = strlen(file_name);
+    if (len <= sizeof(header->name)) {
+        strncpy(header->name, file_name, sizeof(header->name));
+        return 0;
+    }
 
-    compute_checksum(header);
+    // Earliest split that leaves at most 100 bytes for the name field
+    const char *slash = strchr(file_name + len - sizeof(header->name) - 1, '/');
+    if (slash == NULL || slash == file_name || slash - file_name > sizeof(header->prefix) ||
+        slash[1] == '\0') {
+        fprintf(stderr, "File name %s is too long to archive\n", file_name);
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(header->prefix, file_name, slash - file_name);
+    strncpy(header->name, slash + 1, sizeof(header->name));
     return 0;
 }
 
 /*
- * Removes 'nbytes' bytes from the file identified by 'file_name'
- * Returns 0 upon success, -1 upon error
- * Note: This function uses lower-level I/O syscalls (not stdio), which we'll learn about later
+ * Directories are archived as a header alone, so as far as the archive is
+ * concerned their size is zero. Adjusts 'stat_buf', as returned by a stat
+ * call, to match.
+ */
+static void set_member_size(struct stat *stat_buf) {
+    if (S_ISDIR(stat_buf->st_mode)) {
+        stat_buf->st_size = 0;
+    }
+}
+
+/*
+ * Populates a tar header block pointed to by 'header' with metadata about
+ * the file identified by 'file_name', as previously returned by fstat on an
+ * open descriptor for that file in 'stat_buf' and adjusted by
+ * set_member_size. Directories get a name ending in '/'.
+ * Returns 0 on success or -1 if an error occurs
  */
-int remove_trailing_bytes(const char *file_name, size_t nbytes) {
+int fill_tar_header(tar_header *header, const char *file_name, const struct stat *stat_buf) {
+    memset(header, 0, sizeof(tar_header));
     char err_msg[MAX_MSG_LEN];
 
-    struct stat stat_buf;
-    if (stat(file_name, &stat_buf) != 0) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to stat file %s", file_name);
-        perror(err_msg);
+    int is_dir = S_ISDIR(stat_buf->st_mode);
+    size_t name_len = strlen(file_name);
+    const char *header_name = file_name;
+    char dir_name[PATH_MAX + 1];
+    if (is_dir && name_len > 0 && file_name[name_len - 1] != '/') {
+        snprintf(dir_name, sizeof(dir_name), "%s/", file_name);
+        header_name = dir_name;
+    }
+    if (0 != set_header_name(header, header_name)) {    // Name of the file, split if long
         return -1;
     }
+    // Numeric fields are 0-padded octal, or base-256 if too large for that
+    int encode_result = 0;
+    encode_result |= encode_numeric(header->mode, sizeof(header->mode),
+                                    stat_buf->st_mode & 07777);    // Permissions for file
+    encode_result |= encode_numeric(header->uid, sizeof(header->uid),
+                                    stat_buf->st_uid);    // Owner ID of the file
+    encode_result |= encode_numeric(header->gid, sizeof(header->gid),
+                                    stat_buf->st_gid);    // Group ID of the file
 
-    off_t file_size = stat_buf.st_size;
-    if (nbytes > file_size) {
-        file_size = 0;
-    } else {
-        file_size -= nbytes;
+    // With numeric owners, uname and gname stay empty and only the IDs are stored
+    if (!minitar_options.numeric_owner) {
+        const char *uname = lookup_user_name(stat_buf->st_uid);    // Name of owner ID
+        if (uname == NULL) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to look up owner name of file %s", file_name);
+            perror(err_msg);
+            return -1;
+        }
+        strncpy(header->uname, uname, 32);    // Owner name of the file, null-terminated string
+
+        const char *gname = lookup_group_name(stat_buf->st_gid);    // Name of group ID
+        if (gname == NULL) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to look up group name of file %s", file_name);
+            perror(err_msg);
+            return -1;
+        }
+        strncpy(header->gname, gname, 32);    // Group name of the file, null-terminated string
     }
 
-    if (truncate(file_name, file_size) != 0) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to truncate file %s", file_name);
-        perror(err_msg);
+    encode_result |= encode_numeric(header->size, sizeof(header->size),
+                                    stat_buf->st_size);    // File size
+    encode_result |= encode_numeric(header->mtime, sizeof(header->mtime),
+                                    stat_buf->st_mtime);    // Modification time
+    header->typeflag = is_dir ? DIRTYPE : REGTYPE;    // File type
+    strncpy(header->magic, MAGIC, 6);          // Special, standardized sequence of bytes
+    memcpy(header->version, "00", 2);          // A bit weird, sidesteps null termination
+    encode_result |= encode_numeric(header->devmajor, sizeof(header->devmajor),
+                                    major(stat_buf->st_dev));    // Major device number
+    encode_result |= encode_numeric(header->devminor, sizeof(header->devminor),
+                                    minor(stat_buf->st_dev));    // Minor device number
+    if (0 != encode_result) {
+        fprintf(stderr, "Metadata of file %s is too large for a tar header\n", file_name);
+        errno = EOVERFLOW;
+        return -1;
+    }
+
+    compute_checksum(header);
+    return 0;
+}
+
+/*
+ * Adds the member whose header 'header' was written at tar offset 'offset' to
+ * 'builder', taking every field from the header just as a scan of the finished
+ * archive would. Does nothing if 'builder' is NULL.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int index_written_member(index_builder_t *builder, off_t offset,
+                                const tar_header *header) {
+    if (NULL == builder) {
+        return 0;
+    }
+    char name[MAX_MEMBER_NAME_LEN];
+    get_member_name(header, name);
+    if (0 != index_builder_add(builder, name, offset,
+                               decode_numeric(header->size, sizeof(header->size)),
+                               decode_numeric(header->mtime, sizeof(header->mtime)),
+                               decode_numeric(header->mode, sizeof(header->mode)) & 07777,
+                               header->typeflag)) {
+        perror("Failed to add member to index");
         return -1;
     }
     return 0;
 }
 
+/*
+ * Reads up to 'len' bytes from 'fd' into 'buf', retrying after short reads
+ * Returns the number of bytes read, which is less than 'len' only at end of
+ * file, or -1 if an error occurs
+ */
+ssize_t read_all(int fd, void *buf, size_t len) {
+    char *ptr = buf;
+    size_t total = 0;
+    while (total < len) {
+        ssize_t bytes_read = read(fd, ptr + total, len - total);
+        if (bytes_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (bytes_read == 0) {
+            break;
+        }
+        total += bytes_read;
+    }
+    return total;
+}
+
 // Helper to do the adding 2 blocks of 512
-int write_end_blocks(FILE *archive_fp) {
+int write_end_blocks(out_stream_t *archive) {
     char zero_block[BLOCK_SIZE] = {0};
 
-    int write_result = fwrite(zero_block, 1, BLOCK_SIZE, archive_fp);
-    if (BLOCK_SIZE != write_result) {
+    if (0 != out_stream_write(archive, zero_block, BLOCK_SIZE)) {
         perror("Failure writing first zero block to archive file");
         return 1;
     }
 
-    write_result = fwrite(zero_block, 1, BLOCK_SIZE, archive_fp);
-    if (BLOCK_SIZE != write_result) {
+    if (0 != out_stream_write(archive, zero_block, BLOCK_SIZE)) {
         perror("Failure writing second zero block to archive file");
         return 1;
     }
     return 0;
 }
 
-int write_files(FILE *archive_fp, const file_list_t *files) {
-    node_t *ptr = files->head;
-    int archive_close_result = 0;
-    int input_close_result = 0;
-    // Traverse file list
-    while (NULL != ptr) {
-        tar_header header;
-        const char *file_name = ptr->name;
+/*
+ * Returns nonzero if a failed copy_file_range or sendfile call set an errno
+ * meaning the kernel cannot copy between these two descriptors, so a slower
+ * method should be tried instead
+ */
+static int copy_unsupported(int err) {
+    return err == EINVAL || err == ENOSYS || err == EXDEV || err == EOPNOTSUPP ||
+           err == EBADF;
+}
 
-        // Attempt to create header
-        int header_result = fill_tar_header(&header, file_name);
-        if (0 != header_result) {
-            archive_close_result = fclose(archive_fp);
-            return 1;
-        }
+/*
+ * Copies up to 'limit' bytes from 'in_fd' to the current position of
+ * 'out_fd', stopping early only at end of file. Reading starts at the current
+ * position of 'in_fd', or at '*in_offset' if 'in_offset' is not NULL, in
+ * which case the file position is left alone and '*in_offset' is advanced
+ * instead, so several threads can copy out of one descriptor.
+ * '*method' is the fastest copy method still believed to work. Data is moved
+ * inside the kernel with copy_file_range (which can share extents on
+ * filesystems with reflinks) or sendfile where possible; if neither works for
+ * these descriptors '*method' is lowered so later calls skip straight to the
+ * read/write loop through 'buf', which holds 'buf_size' bytes.
+ * If 'hash' is not NULL, every byte copied is also added to it; that needs
+ * the data in userspace, so only the read/write loop is used.
+ * Stores the number of bytes copied in 'copied'.
+ * Returns 0 on success or -1 if an error occurs
+ */
+int copy_bytes(int in_fd, off_t *in_offset, int out_fd, size_t limit, copy_method_t *method,
+               char *buf, size_t buf_size, size_t *copied, fingerprint_t *hash) {
+    *copied = 0;
+    int done = 0;
 
-        // Attempt to write header to archive file
-        int write_result = fwrite(&header, sizeof(tar_header), 1, archive_fp);
-        if (1 != write_result) {
-            perror("Failed to write header to archive file");
-            archive_close_result = fclose(archive_fp);
-            return 1;
+    while (!done && *copied < limit && *method == COPY_FILE_RANGE && NULL == hash) {
+        size_t chunk = limit - *copied < buf_size ? limit - *copied : buf_size;
+        ssize_t result = copy_file_range(in_fd, in_offset, out_fd, NULL, chunk, 0);
+        if (result > 0) {
+            *copied += result;
+        } else if (result == 0) {
+            done = 1;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (copy_unsupported(errno)) {
+            *method = COPY_SENDFILE;
+        } else {
+            perror("Failure copying file data");
+            return -1;
         }
+    }
 
-        // Attempt to open input file
-        FILE *input_fp = fopen(file_name, "rb");
-        if (NULL == input_fp) {
-            perror("Failed to open input file for read");
-            archive_close_result = fclose(archive_fp);
-            return 1;
+    while (!done && *copied < limit && *method == COPY_SENDFILE && NULL == hash) {
+        size_t chunk = limit - *copied < buf_size ? limit - *copied : buf_size;
+        ssize_t result = sendfile(out_fd, in_fd, in_offset, chunk);
+        if (result > 0) {
+            *copied += result;
+        } else if (result == 0) {
+            done = 1;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (copy_unsupported(errno)) {
+            *method = COPY_READ_WRITE;
+        } else {
+            perror("Failure copying file data");
+            return -1;
         }
+    }
 
-        char buffer[BLOCK_SIZE];
-        size_t bytes_read;
-
-        // Read and write file contents in 512-byte blocks
-        while ((bytes_read = fread(buffer, 1, sizeof(buffer), input_fp)) > 0) {
-            // Check if what we read in was less than 512 -> need to pad
-            if (bytes_read < sizeof(buffer)) {
-                memset(buffer + bytes_read, 0, sizeof(buffer) - bytes_read);
+    while (!done && *copied < limit) {
+        size_t chunk = limit - *copied < buf_size ? limit - *copied : buf_size;
+        ssize_t bytes_read = NULL == in_offset ? read(in_fd, buf, chunk)
+                                               : pread(in_fd, buf, chunk, *in_offset);
+        if (bytes_read < 0) {
+            if (errno == EINTR) {
+                continue;
             }
-
-            // Write the full 512-byte block
-            size_t bytes_wrote = fwrite(buffer, 1, sizeof(buffer), archive_fp);
-            if (bytes_wrote != sizeof(buffer)) {
-                perror("Failure writing to archive file");
-                fclose(input_fp);
-                fclose(archive_fp);
-                return 1;
+            perror("Failure reading file data");
+            return -1;
+        } else if (bytes_read == 0) {
+            done = 1;
+        } else if (0 != write_all(out_fd, buf, bytes_read)) {
+            perror("Failure writing file data");
+            return -1;
+        } else {
+            if (NULL != hash) {
+                fingerprint_update(hash, buf, bytes_read);
+            }
+            *copied += bytes_read;
+            if (NULL != in_offset) {
+                *in_offset += bytes_read;
             }
         }
+    }
+    return 0;
+}
 
-        input_close_result = fclose(input_fp);
-        if (0 != input_close_result) {
-            perror("Failure closing input file");
-            fclose(archive_fp);
-            return 1;
-        }
+/*
+ * Opens the member file 'file_name' for reading, without updating its access
+ * time when permitted (O_NOATIME requires owning the file)
+ * Returns the new fd, or -1 if an error occurs
+ */
+int open_member(const char *file_name) {
+    int fd = open(file_name, O_RDONLY | O_NOATIME);
+    if (-1 == fd && errno == EPERM) {
+        fd = open(file_name, O_RDONLY);
+    }
+    return fd;
+}
 
-        ptr = ptr->next;
+/*
+ * Finishes a member whose header recorded 'size' bytes of data after only
+ * 'copied' of them were found in the file: the missing bytes (if the file
+ * shrank) are written as zeros, then the archive is zero-padded out to the next
+ * block boundary. 'buf' is scratch space of 'buf_size' bytes.
+ * Returns 0 on success or -1 if an error occurs
+ */
+int write_member_padding(out_stream_t *archive, size_t size, size_t copied, const char *file_name,
+                         char *buf, size_t buf_size) {
+    size_t zeros = size - copied;
+    if (zeros > 0) {
+        fprintf(stderr, "File %s shrank by %zu bytes, padding with zeros\n", file_name, zeros);
     }
-    if (0 != archive_close_result) {
-        perror("Failure closing archive file");
+    // Only the tail of the final block is written from userspace
+    zeros += (BLOCK_SIZE - size % BLOCK_SIZE) % BLOCK_SIZE;
+    if (zeros > 0) {
+        memset(buf, 0, zeros < buf_size ? zeros : buf_size);
+    }
+    while (zeros > 0) {
+        size_t chunk = zeros < buf_size ? zeros : buf_size;
+        if (0 != out_stream_write(archive, buf, chunk)) {
+            perror("Failure writing padding to archive file");
+            return -1;
+        }
+        zeros -= chunk;
+    }
+    return 0;
+}
+
+/*
+ * Copies exactly 'size' bytes of member data from 'input_fd' into the
+ * uncompressed 'archive' with copy_bytes, working on its fd directly, and
+ * then pads the member with write_member_padding. 'size'
+ * is the size recorded in the member's header: if the file has grown since it
+ * was stat'd the extra bytes are left out, and if it has shrunk the missing
+ * bytes are written as zeros, so the archive always matches its headers.
+ * Adds the number of data bytes copied from the file to 'nbytes', and the
+ * bytes themselves to 'hash' unless it is NULL.
+ * Returns 0 on success or -1 if an error occurs
+ */
+int copy_file_data(int input_fd, out_stream_t *archive, size_t size, const char *file_name,
+                   copy_method_t *method, char *buf, size_t buf_size, size_t *nbytes,
+                   fingerprint_t *hash) {
+    size_t copied;
+    if (0 != copy_bytes(input_fd, NULL, archive->fd, size, method, buf, buf_size, &copied,
+                        hash)) {
         return -1;
     }
+    *nbytes += copied;
+    return write_member_padding(archive, size, copied, file_name, buf, buf_size);
+}
 
-    return 0;
+/*
+ * Version of copy_file_data for compressed archives, which cannot be written
+ * to in the kernel: 'size' bytes of member data are read from 'input_fd' into
+ * 'buf' and passed through the encoder of 'archive', then padded with
+ * write_member_padding.
+ * Adds the number of data bytes read from the file to 'nbytes', and the bytes
+ * themselves to 'hash' unless it is NULL.
+ * Returns 0 on success or -1 if an error occurs
+ */
+int stream_file_data(int input_fd, out_stream_t *archive, size_t size, const char *file_name,
+                     char *buf, size_t buf_size, size_t *nbytes, fingerprint_t *hash) {
+    size_t copied = 0;
+    while (copied < size) {
+        size_t chunk = size - copied < buf_size ? size - copied : buf_size;
+        ssize_t bytes_read = read_all(input_fd, buf, chunk);
+        if (bytes_read < 0) {
+            perror("Failure reading file data");
+            return -1;
+        }
+        if (NULL != hash) {
+            fingerprint_update(hash, buf, bytes_read);
+        }
+        if (0 != out_stream_write(archive, buf, bytes_read)) {
+            perror("Failure writing file data");
+            return -1;
+        }
+        copied += bytes_read;
+        if (bytes_read < chunk) {
+            break;
+        }
+    }
+    *nbytes += copied;
+    return write_member_padding(archive, size, copied, file_name, buf, buf_size);
 }
-int create_archive(const char *archive_name, const file_list_t *files) {
-    FILE *archive_fp = fopen(archive_name, "wb");
-    int archive_close_result = 0;
 
-    if (NULL == archive_fp) {
-        perror("Error opening archive file for write");
-        return 1;
+// Names of the copy methods, for statistics
+static const char *method_names[] = {"copy_file_range", "sendfile", "read/write"};
+
+// Names of the compression formats, for statistics
+static const char *compression_names[] = {"none", "gzip", "zstd"};
+
+/*
+ * Prints the statistics for one run of write_files when in verbose mode.
+ * 'how' names the way member data was moved.
+ */
+static void report_write_stats(size_t bytes_copied, const char *how, double start_time) {
+    if (minitar_options.verbose) {
+        double elapsed = now_seconds() - start_time;
+        fprintf(stderr, "Copied %zu bytes with %s in %.3f s (%.1f MiB/s)\n", bytes_copied, how,
+                elapsed,
+                elapsed > 0 ? bytes_copied / elapsed / (1 << 20) : 0.0);
+        fprintf(stderr, "Name cache: owners %zu hits, %zu misses; groups %zu hits, %zu misses\n",
+                uid_cache.hits, uid_cache.misses, gid_cache.hits, gid_cache.misses);
     }
+}
 
-    // Attempt to write the files
-    int write_files_result = write_files(archive_fp, files);
-    if (0 != write_files_result) {
-        perror("Error writing files");
-        return 1;
+// States of a slot in the parallel create pipeline
+#define SLOT_EMPTY 0
+#define SLOT_READY 1
+#define SLOT_FAILED 2
+
+// One member prepared ahead of time by a reader thread for the archive writer
+typedef struct {
+    int state;
+    // Metadata from fstat on the member's descriptor
+    struct stat stat_buf;
+    // Leading bytes of the member's data, 'data_len' of which are valid
+    char *data;
+    size_t data_len;
+    // Still open if the member holds more data than fit in 'data', else -1
+    int input_fd;
+    // errno and description of the failed step when state is SLOT_FAILED
+    int err;
+    const char *err_msg;
+} member_slot_t;
+
+// State shared between the reader threads and the writer in write_files_parallel
+typedef struct {
+    const file_list_t *files;
+    // Ring of slots: member i is prepared in slot i % num_slots
+    member_slot_t *slots;
+    int num_slots;
+    size_t slot_size;
+    // Next member for a reader to claim, and next member the writer will emit
+    int next_index;
+    int write_index;
+    // Set by the writer to make readers stop early after an error
+    int abort;
+    pthread_mutex_t lock;
+    pthread_cond_t slot_freed;
+    pthread_cond_t slot_ready;
+} pipeline_t;
+
+/*
+ * Opens, stats and reads the start of member 'index' into its slot. Called
+ * by reader threads without the pipeline lock held; the slot is theirs alone
+ * until the caller publishes the returned state under the lock.
+ * Returns SLOT_READY on success or SLOT_FAILED if an error occurs
+ */
+static int prepare_member(pipeline_t *pipeline, int index) {
+    member_slot_t *slot = &pipeline->slots[index % pipeline->num_slots];
+    slot->input_fd = -1;
+    slot->data_len = 0;
+
+    int fd = open_member(pipeline->files->entries[index].name);
+    if (-1 == fd) {
+        slot->err = errno;
+        slot->err_msg = "Failed to open input file for read";
+        return SLOT_FAILED;
     }
-    // Data should have been written, now we need to add the 2 blocks of padding
-    int add_zero_block_result = write_end_blocks(archive_fp);
-    if (0 != add_zero_block_result) {
-        archive_close_result = fclose(archive_fp);
-        return 1;
+    if (0 != fstat(fd, &slot->stat_buf)) {
+        slot->err = errno;
+        slot->err_msg = "Failed to stat input file";
+        close(fd);
+        return SLOT_FAILED;
     }
-    // Close archive fp
-    archive_close_result = fclose(archive_fp);
-    if (0 != archive_close_result) {
-        perror("Failure closing archive file");
-        return 1;
+    set_member_size(&slot->stat_buf);
+
+    size_t size = slot->stat_buf.st_size;
+    size_t want = size < pipeline->slot_size ? size : pipeline->slot_size;
+    ssize_t bytes_read = read_all(fd, slot->data, want);
+    if (bytes_read < 0) {
+        slot->err = errno;
+        slot->err_msg = "Failure reading input file";
+        close(fd);
+        return SLOT_FAILED;
     }
+    slot->data_len = bytes_read;
 
-    return 0;
+    // Keep the descriptor only if the writer has to stream the rest of the data
+    if (slot->data_len == pipeline->slot_size && slot->data_len < size) {
+        slot->input_fd = fd;
+    } else {
+        close(fd);
+    }
+    return SLOT_READY;
 }
 
-int append_files_to_archive(const char *archive_name, const file_list_t *files) {
-    // First check that archive exists
-    FILE *check_archive_fp = fopen(archive_name, "rb");
-    int archive_close_result = 0;
-    if (check_archive_fp == NULL) {
-        perror("Archive file does not exist");
-        return 1;
-    }
-    archive_close_result = fclose(check_archive_fp);
+/*
+ * Reader thread: claims members in list order, staying at most num_slots
+ * members ahead of the writer so memory use is bounded
+ */
+static void *pipeline_reader(void *arg) {
+    pipeline_t *pipeline = arg;
+    pthread_mutex_lock(&pipeline->lock);
+    while (!pipeline->abort && pipeline->next_index < pipeline->files->size) {
+        if (pipeline->next_index >= pipeline->write_index + pipeline->num_slots) {
+            pthread_cond_wait(&pipeline->slot_freed, &pipeline->lock);
+            continue;
+        }
+        int index = pipeline->next_index++;
+        pthread_mutex_unlock(&pipeline->lock);
 
-    // Remove the footer (two 512-byte zero blocks)
-    if (remove_trailing_bytes(archive_name, 1024) != 0) {
-        perror("Error removing bytes");
-        return 1;
+        int state = prepare_member(pipeline, index);
+
+        pthread_mutex_lock(&pipeline->lock);
+        pipeline->slots[index % pipeline->num_slots].state = state;
+        pthread_cond_broadcast(&pipeline->slot_ready);
     }
+    pthread_mutex_unlock(&pipeline->lock);
+    return NULL;
+}
 
-    // Atempt to open archive
-    FILE *archive_fp = fopen(archive_name, "r+b");
-    if (archive_fp == NULL) {
-        perror("Failure opening archive file");
-        return 1;
+/*
+ * Emits the header and data of the member prepared in 'slot' to the
+ * uncompressed 'archive', adding the member to 'builder' unless it is NULL
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int emit_member(out_stream_t *archive, const char *file_name, member_slot_t *slot,
+                       copy_method_t *method, char *buf, size_t buf_size, size_t *nbytes,
+                       index_builder_t *builder) {
+    int archive_fd = archive->fd;
+    if (slot->state == SLOT_FAILED) {
+        errno = slot->err;
+        perror(slot->err_msg);
+        return -1;
     }
 
-    // We removed the footer but now we need to position
-    // the fp at the end so that it is in position
-    // to start writing the files
-    int seek_result = fseek(archive_fp, 0, SEEK_END);
-    if (0 != seek_result) {
+    // Headers are filled here, on the writer, so the name caches need no locking
+    tar_header header;
+    if (0 != fill_tar_header(&header, file_name, &slot->stat_buf)) {
+        return -1;
+    }
+    off_t offset = NULL == builder ? 0 : lseek(archive_fd, 0, SEEK_CUR);
+    if (-1 == offset) {
         perror("Failure seeking archive file");
-        return 1;
+        return -1;
+    }
+    if (0 != index_written_member(builder, offset, &header)) {
+        return -1;
+    }
+    if (0 != write_all(archive_fd, &header, sizeof(tar_header))) {
+        perror("Failed to write header to archive file");
+        return -1;
     }
 
-    // Do the adding of files
-    int write_files_result = write_files(archive_fp, files);
-    if (0 != write_files_result) {
-        perror("Error writing files");
-        return 1;
+    size_t size = slot->stat_buf.st_size;
+    size_t copied = slot->data_len < size ? slot->data_len : size;
+    if (0 != write_all(archive_fd, slot->data, copied)) {
+        perror("Failure writing to archive file");
+        return -1;
+    }
+    if (slot->input_fd != -1) {
+        size_t rest;
+        if (0 != copy_bytes(slot->input_fd, NULL, archive_fd, size - copied, method, buf,
+                            buf_size, &rest, NULL)) {
+            return -1;
+        }
+        copied += rest;
     }
+    *nbytes += copied;
+    return write_member_padding(archive, size, copied, file_name, buf, buf_size);
+}
 
-    // Now add new footer
-    int add_zero_block_result = write_end_blocks(archive_fp);
-    if (0 != add_zero_block_result) {
-        fclose(archive_fp);
+/*
+ * Parallel version of write_files used with -j: 'num_threads' reader threads
+ * open, stat and read members ahead into a bounded ring of buffers while this
+ * thread writes headers and data strictly in list order, so the archive is
+ * byte-identical to the one the serial path produces. Members are added to
+ * 'builder' unless it is NULL, like write_files.
+ * Closes the archive fd on error, like write_files.
+ * Returns 0 on success or 1 if an error occurs
+ */
+int write_files_parallel(out_stream_t *archive, const file_list_t *files, int num_threads,
+                         index_builder_t *builder) {
+    int archive_fd = archive->fd;
+    pipeline_t pipeline = {
+        .files = files,
+        .num_slots = num_threads * 2,
+        .slot_size = minitar_options.copy_buf_size,
+    };
+    size_t alloc_size =
+        (pipeline.slot_size + COPY_BUF_ALIGN - 1) / COPY_BUF_ALIGN * COPY_BUF_ALIGN;
+
+    // One extra buffer for the writer's own copies and padding
+    char *buffers = aligned_alloc(COPY_BUF_ALIGN, alloc_size * (pipeline.num_slots + 1));
+    pipeline.slots = calloc(pipeline.num_slots, sizeof(member_slot_t));
+    pthread_t *threads = calloc(num_threads, sizeof(pthread_t));
+    if (NULL == buffers || NULL == pipeline.slots || NULL == threads) {
+        perror("Failed to allocate read-ahead buffers");
+        free(buffers);
+        free(pipeline.slots);
+        free(threads);
+        close(archive_fd);
         return 1;
     }
+    for (int i = 0; i < pipeline.num_slots; i++) {
+        pipeline.slots[i].state = SLOT_EMPTY;
+        pipeline.slots[i].data = buffers + alloc_size * (i + 1);
+    }
+    pthread_mutex_init(&pipeline.lock, NULL);
+    pthread_cond_init(&pipeline.slot_freed, NULL);
+    pthread_cond_init(&pipeline.slot_ready, NULL);
 
-    // Close archive fp
-    archive_close_result = fclose(archive_fp);
-    if (0 != archive_close_result) {
-        perror("Failure closing archive file");
-        return 1;
+    int started = 0;
+    while (started < num_threads &&
+           0 == pthread_create(&threads[started], NULL, pipeline_reader, &pipeline)) {
+        started++;
+    }
+
+    copy_method_t method = COPY_FILE_RANGE;
+    size_t bytes_copied = 0;
+    double start_time = now_seconds();
+    int result = started > 0 ? 0 : 1;
+    if (started == 0) {
+        fprintf(stderr, "Failed to start reader threads\n");
     }
 
+    for (int i = 0; i < files->size && result == 0; i++) {
+        member_slot_t *slot = &pipeline.slots[i % pipeline.num_slots];
+        pthread_mutex_lock(&pipeline.lock);
+        while (slot->state == SLOT_EMPTY) {
+            pthread_cond_wait(&pipeline.slot_ready, &pipeline.lock);
+        }
+        pthread_mutex_unlock(&pipeline.lock);
+
+        if (0 != emit_member(archive, files->entries[i].name, slot, &method, buffers,
+                             pipeline.slot_size, &bytes_copied, builder)) {
+            result = 1;
+        }
+        if (slot->input_fd != -1) {
+            close(slot->input_fd);
+            slot->input_fd = -1;
+        }
+
+        pthread_mutex_lock(&pipeline.lock);
+        slot->state = SLOT_EMPTY;
+        pipeline.write_index = i + 1;
+        pthread_cond_broadcast(&pipeline.slot_freed);
+        pthread_mutex_unlock(&pipeline.lock);
+    }
+
+    // Stop the readers, then release anything they prepared that was never written
+    pthread_mutex_lock(&pipeline.lock);
+    pipeline.abort = 1;
+    pthread_cond_broadcast(&pipeline.slot_freed);
+    pthread_mutex_unlock(&pipeline.lock);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (int i = 0; i < pipeline.num_slots; i++) {
+        if (pipeline.slots[i].state == SLOT_READY && pipeline.slots[i].input_fd != -1) {
+            close(pipeline.slots[i].input_fd);
+        }
+    }
+    pthread_cond_destroy(&pipeline.slot_ready);
+    pthread_cond_destroy(&pipeline.slot_freed);
+    pthread_mutex_destroy(&pipeline.lock);
+    free(threads);
+    free(pipeline.slots);
+    free(buffers);
+
+    if (result != 0) {
+        close(archive_fd);
+        return result;
+    }
+    report_write_stats(bytes_copied, method_names[method], start_time);
     return 0;
 }
 
-int get_archive_file_list(const char *archive_name, file_list_t *files) {
-    // TODO: Not yet implemented
-    return 0;
+/*
+ * Converts the fields of 'stx' that fill_tar_header uses into 'stat_buf'
+ */
+static void statx_to_stat(const struct statx *stx, struct stat *stat_buf) {
+    memset(stat_buf, 0, sizeof(struct stat));
+    stat_buf->st_mode = stx->stx_mode;
+    stat_buf->st_uid = stx->stx_uid;
+    stat_buf->st_gid = stx->stx_gid;
+    stat_buf->st_size = stx->stx_size;
+    stat_buf->st_mtime = stx->stx_mtime.tv_sec;
+    stat_buf->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    set_member_size(stat_buf);
 }
 
-int extract_files_from_archive(const char *archive_name) {
-    // TODO: Not yet implemented
-    return 0;
+/*
+ * Writes one member too large for the io_uring staging buffer at 'offset' in
+ * the archive using the synchronous copy engine, then closes 'input_fd'.
+ * The member is added to 'builder' unless it is NULL.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int write_large_member(out_stream_t *archive, off_t offset, int input_fd,
+                              const char *file_name, const struct stat *stat_buf,
+                              copy_method_t *method, char *buf, size_t buf_size, size_t *nbytes,
+                              index_builder_t *builder) {
+    int archive_fd = archive->fd;
+    tar_header header;
+    int result = fill_tar_header(&header, file_name, stat_buf);
+    if (0 == result) {
+        result = index_written_member(builder, offset, &header);
+    }
+    if (0 == result && sizeof(tar_header) != pwrite(archive_fd, &header, sizeof(tar_header),
+                                                    offset)) {
+        perror("Failed to write header to archive file");
+        result = -1;
+    }
+    if (0 == result && -1 == lseek(archive_fd, offset + BLOCK_SIZE, SEEK_SET)) {
+        perror("Failure seeking archive file");
+        result = -1;
+    }
+    if (0 == result) {
+        result = copy_file_data(input_fd, archive, stat_buf->st_size, file_name, method, buf,
+                                buf_size, nbytes, NULL);
+    }
+    close(input_fd);
+    return result;
+}
+
+/*
+ * io_uring version of write_files used with --io-uring. Members are handled
+ * URING_BATCH at a time: all opens of a batch are in flight together, then all
+ * statx calls, then the reads of every member whose header and data fit in the
+ * staging buffer, then a single write of those members (laid out exactly as
+ * in the archive) alongside the closes of their input files. Members too large
+ * to stage go through the synchronous copy engine instead.
+ * Writes at explicit offsets starting from the current position of the
+ * uncompressed 'archive', and leaves it positioned after the last member.
+ * Members are added to 'builder' unless it is NULL, like write_files.
+ * Closes the archive fd on error, like write_files.
+ * Returns 0 on success or 1 if an error occurs
+ */
+int write_files_uring(uring_t *ring, out_stream_t *archive, const file_list_t *files,
+                      index_builder_t *builder) {
+    int archive_fd = archive->fd;
+    size_t buf_size = minitar_options.copy_buf_size;
+    size_t staging_size = buf_size * URING_STAGING_BUFS;
+    char *buffer = alloc_copy_buffer(buf_size);
+    char *staging = alloc_copy_buffer(staging_size);
+    off_t offset = lseek(archive_fd, 0, SEEK_CUR);
+    if (NULL == buffer || NULL == staging || -1 == offset) {
+        perror("Failed to set up io_uring buffers");
+        free(buffer);
+        free(staging);
+        close(archive_fd);
+        return 1;
+    }
+
+    int fds[URING_BATCH];
+    int results[URING_BATCH * 2];
+    struct statx stx[URING_BATCH];
+    struct stat stat_bufs[URING_BATCH];
+    size_t region_offsets[URING_BATCH];
+    copy_method_t method = COPY_FILE_RANGE;
+    size_t bytes_copied = 0;
+    double start_time = now_seconds();
+    int result = 0;
+
+    for (int start = 0; start < files->size && result == 0; start += URING_BATCH) {
+        int count = files->size - start < URING_BATCH ? files->size - start : URING_BATCH;
+        const node_t *names = &files->entries[start];
+
+        // Open every member of the batch at once
+        for (int k = 0; k < count; k++) {
+            struct io_uring_sqe *sqe = uring_get_sqe(ring);
+            uring_prep_openat(sqe, AT_FDCWD, names[k].name, O_RDONLY | O_NOATIME, 0);
+            sqe->user_data = k;
+        }
+        if (0 != uring_run(ring, fds, count)) {
+            perror("Failed to submit io_uring operations");
+            result = 1;
+            break;
+        }
+        for (int k = 0; k < count; k++) {
+            // O_NOATIME needs ownership of the file, so retry without it
+            if (fds[k] == -EPERM) {
+                fds[k] = open_member(names[k].name);
+                fds[k] = fds[k] == -1 ? -errno : fds[k];
+            }
+            if (fds[k] < 0 && result == 0) {
+                errno = -fds[k];
+                perror("Failed to open input file for read");
+                result = 1;
+            }
+        }
+
+        // Then stat every open descriptor
+        for (int k = 0; k < count && result == 0; k++) {
+            struct io_uring_sqe *sqe = uring_get_sqe(ring);
+            uring_prep_statx(sqe, fds[k], "", AT_EMPTY_PATH, STATX_BASIC_STATS, &stx[k]);
+            sqe->user_data = k;
+        }
+        if (result == 0 && 0 != uring_run(ring, results, count)) {
+            perror("Failed to submit io_uring operations");
+            result = 1;
+        }
+        for (int k = 0; k < count && result == 0; k++) {
+            if (results[k] < 0) {
+                errno = -results[k];
+                perror("Failed to stat input file");
+                result = 1;
+            }
+            statx_to_stat(&stx[k], &stat_bufs[k]);
+        }
+
+        int k = 0;
+        while (k < count && result == 0) {
+            // Gather consecutive members whose blocks fit in the staging buffer
+            int round_start = k;
+            size_t used = 0;
+            while (k < count) {
+                size_t size = stat_bufs[k].st_size;
+                size_t region = BLOCK_SIZE + (size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+                if (used + region > staging_size) {
+                    break;
+                }
+                region_offsets[k] = used;
+                used += region;
+                k++;
+            }
+            if (k == round_start) {
+                size_t size = stat_bufs[k].st_size;
+                result = write_large_member(archive, offset, fds[k], names[k].name,
+                                            &stat_bufs[k], &method, buffer, buf_size,
+                                            &bytes_copied, builder);
+                fds[k] = -1;
+                offset += BLOCK_SIZE + (size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+                k++;
+                continue;
+            }
+
+            // Read the data of the whole round
+            for (int j = round_start; j < k; j++) {
+                struct io_uring_sqe *sqe = uring_get_sqe(ring);
+                uring_prep_read(sqe, fds[j], staging + region_offsets[j] + BLOCK_SIZE,
+                                stat_bufs[j].st_size, 0);
+                sqe->user_data = j - round_start;
+            }
+            if (0 != uring_run(ring, results, k - round_start)) {
+                perror("Failed to submit io_uring operations");
+                result = 1;
+                break;
+            }
+
+            for (int j = round_start; j < k && result == 0; j++) {
+                char *region = staging + region_offsets[j];
+                size_t size = stat_bufs[j].st_size;
+                int bytes_read = results[j - round_start];
+                if (bytes_read < 0) {
+                    errno = -bytes_read;
+                    perror("Failure reading input file");
+                    result = 1;
+                    break;
+                }
+                if (0 != fill_tar_header((tar_header *) region, names[j].name, &stat_bufs[j]) ||
+                    0 != index_written_member(builder, offset + region_offsets[j],
+                                              (tar_header *) region)) {
+                    result = 1;
+                    break;
+                }
+                // A read can come back short without the file having
+                // changed; only stop once the file reports its end
+                while (bytes_read < size) {
+                    ssize_t more = pread(fds[j], region + BLOCK_SIZE + bytes_read,
+                                         size - bytes_read, bytes_read);
+                    if (more < 0 && errno == EINTR) {
+                        continue;
+                    }
+                    if (more < 0) {
+                        perror("Failure reading input file");
+                        result = 1;
+                        break;
+                    }
+                    if (more == 0) {
+                        break;
+                    }
+                    bytes_read += more;
+                }
+                if (result != 0) {
+                    break;
+                }
+                if (bytes_read < size) {
+                    fprintf(stderr, "File %s shrank by %zu bytes, padding with zeros\n",
+                            names[j].name, size - bytes_read);
+                }
+                size_t region_len = BLOCK_SIZE + (size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+                memset(region + BLOCK_SIZE + bytes_read, 0, region_len - BLOCK_SIZE - bytes_read);
+                bytes_copied += bytes_read;
+            }
+            if (result != 0) {
+                break;
+            }
+
+            // One write covers the round, with the input files closed alongside it
+            struct io_uring_sqe *sqe = uring_get_sqe(ring);
+            uring_prep_write(sqe, archive_fd, staging, used, offset);
+            sqe->user_data = 0;
+            for (int j = round_start; j < k; j++) {
+                sqe = uring_get_sqe(ring);
+                uring_prep_close(sqe, fds[j]);
+                sqe->user_data = 1 + j - round_start;
+                fds[j] = -1;
+            }
+            if (0 != uring_run(ring, results, 1 + k - round_start)) {
+                perror("Failed to submit io_uring operations");
+                result = 1;
+                break;
+            }
+            if (results[0] < 0) {
+                errno = -results[0];
+                perror("Failure writing to archive file");
+                result = 1;
+                break;
+            }
+            // Finish a short write synchronously
+            size_t written = results[0];
+            while (written < used && result == 0) {
+                ssize_t more = pwrite(archive_fd, staging + written, used - written,
+                                      offset + written);
+                if (more <= 0) {
+                    perror("Failure writing to archive file");
+                    result = 1;
+                }
+                written += more > 0 ? more : 0;
+            }
+            offset += used;
+        }
+
+        // Close anything an error left open
+        for (int k = 0; k < count; k++) {
+            if (fds[k] >= 0) {
+                close(fds[k]);
+            }
+        }
+    }
+    free(staging);
+    free(buffer);
+
+    if (result != 0) {
+        close(archive_fd);
+        return result;
+    }
+    if (-1 == lseek(archive_fd, offset, SEEK_SET)) {
+        perror("Failure seeking archive file");
+        close(archive_fd);
+        return 1;
+    }
+    report_write_stats(bytes_copied, "io_uring", start_time);
+    return 0;
+}
+
+/*
+ * Writes a header and the data of every file in 'files' to 'archive'.
+ * Uncompressed archives may use io_uring (--io-uring), reader threads (-j) or
+ * in-kernel copies; compressed archives are written serially through the
+ * stream's encoder, since every byte has to pass through the compressor (with
+ * -j, the encoder itself spreads compression over threads).
+ * If 'first_header' is not NULL, the first member's header is stored there
+ * instead of being written, leaving its block in the archive untouched; the
+ * caller writes it later. Such writes are always serial.
+ * If 'fingerprints' is not NULL, the XXH64 hash of each member's data is
+ * stored in it, one per entry of 'files'. Each hash is computed from the copy
+ * buffer as the data passes through it, so the files are still read only
+ * once, but the copy is serial and stays out of the kernel's fast paths.
+ * If 'builder' is not NULL, every member written is added to it at its offset
+ * in the tar stream, with its hash when 'fingerprints' is also given, so an
+ * index can be written without reading the archive back. Files modified in or
+ * after the second writing starts are marked racy in it.
+ * Closes the archive fd on error.
+ * Returns 0 on success or 1 if an error occurs
+ */
+int write_files(out_stream_t *archive, const file_list_t *files, tar_header *first_header,
+                uint64_t *fingerprints, index_builder_t *builder) {
+    int archive_fd = archive->fd;
+    int compressed = archive->compression != COMPRESS_NONE;
+    // Only the serial writer below knows how to hold a header back or hash
+    // member data
+    int serial = NULL != first_header || NULL != fingerprints;
+    // Every member's data is read after this, so a file whose mtime is
+    // earlier cannot have changed since without its mtime moving on
+    if (NULL != builder) {
+        builder->racy_from = time(NULL);
+    }
+    if (!serial && !compressed && minitar_options.use_io_uring) {
+        uring_t ring;
+        static const unsigned char needed[] = {IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ,
+                                               IORING_OP_WRITE, IORING_OP_CLOSE};
+        if (0 == uring_init(&ring, URING_BATCH * 2)) {
+            if (uring_supports(&ring, needed, sizeof(needed))) {
+                int result = write_files_uring(&ring, archive, files, builder);
+                uring_exit(&ring);
+                return result;
+            }
+            uring_exit(&ring);
+        }
+        if (minitar_options.verbose) {
+            fprintf(stderr, "io_uring unavailable, using synchronous I/O\n");
+        }
+    }
+    if (!serial && !compressed && minitar_options.num_threads > 1 && files->size > 1) {
+        return write_files_parallel(archive, files, minitar_options.num_threads, builder);
+    }
+
+    // Fallback buffer shared by every member, sized so large files move in few calls
+    size_t buf_size = minitar_options.copy_buf_size;
+    char *buffer = alloc_copy_buffer(buf_size);
+    if (NULL == buffer) {
+        perror("Failed to allocate copy buffer");
+        close(archive_fd);
+        return 1;
+    }
+    copy_method_t method = NULL == fingerprints ? COPY_FILE_RANGE : COPY_READ_WRITE;
+    size_t bytes_copied = 0;
+    double start_time = now_seconds();
+    // Tar offset of the next header. Compressed archives are only ever
+    // written from the start
+    off_t offset = compressed ? 0 : lseek(archive_fd, 0, SEEK_CUR);
+    if (-1 == offset) {
+        perror("Failure seeking archive file");
+        free(buffer);
+        close(archive_fd);
+        return 1;
+    }
+
+    // Traverse file list
+    for (int i = 0; i < files->size; i++) {
+        tar_header header;
+        const char *file_name = files->entries[i].name;
+
+        // Attempt to open input file. Its metadata and data both come from
+        // this one descriptor, so the name is only resolved once
+        int input_fd = open_member(file_name);
+        if (-1 == input_fd) {
+            perror("Failed to open input file for read");
+            free(buffer);
+            close(archive_fd);
+            return 1;
+        }
+
+        // Attempt to create header
+        struct stat stat_buf;
+        if (0 != fstat(input_fd, &stat_buf)) {
+            perror("Failed to stat input file");
+            free(buffer);
+            close(input_fd);
+            close(archive_fd);
+            return 1;
+        }
+        set_member_size(&stat_buf);
+        int header_result = fill_tar_header(&header, file_name, &stat_buf);
+        if (0 == header_result) {
+            header_result = index_written_member(builder, offset, &header);
+        }
+        if (0 != header_result) {
+            free(buffer);
+            close(input_fd);
+            close(archive_fd);
+            return 1;
+        }
+
+        // Attempt to write header to archive file
+        if (0 == i && NULL != first_header) {
+            *first_header = header;
+            if (-1 == lseek(archive_fd, sizeof(tar_header), SEEK_CUR)) {
+                perror("Failed to skip header in archive file");
+                free(buffer);
+                close(input_fd);
+                close(archive_fd);
+                return 1;
+            }
+        } else if (0 != out_stream_write(archive, &header, sizeof(tar_header))) {
+            perror("Failed to write header to archive file");
+            free(buffer);
+            close(input_fd);
+            close(archive_fd);
+            return 1;
+        }
+
+        fingerprint_t hash;
+        fingerprint_t *hash_ptr = NULL == fingerprints ? NULL : &hash;
+        if (NULL != hash_ptr) {
+            fingerprint_init(hash_ptr);
+        }
+        int copy_result;
+        if (compressed) {
+            copy_result = stream_file_data(input_fd, archive, stat_buf.st_size, file_name, buffer,
+                                           buf_size, &bytes_copied, hash_ptr);
+        } else {
+            copy_result = copy_file_data(input_fd, archive, stat_buf.st_size, file_name,
+                                         &method, buffer, buf_size, &bytes_copied, hash_ptr);
+        }
+        if (NULL != hash_ptr) {
+            fingerprints[i] = fingerprint_digest(hash_ptr);
+            if (NULL != builder) {
+                index_builder_set_fingerprint(builder, fingerprints[i]);
+            }
+        }
+        offset += BLOCK_SIZE + (stat_buf.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+        if (0 != copy_result) {
+            free(buffer);
+            close(input_fd);
+            close(archive_fd);
+            return 1;
+        }
+
+        if (0 != close(input_fd)) {
+            perror("Failure closing input file");
+            free(buffer);
+            close(archive_fd);
+            return 1;
+        }
+    }
+    free(buffer);
+
+    const char *how = compressed ? compression_names[archive->compression] : method_names[method];
+    report_write_stats(bytes_copied, how, start_time);
+    return 0;
+}
+
+/*
+ * Stores the name of the index file of the archive 'archive_name' in 'buf'
+ * Returns 0 on success or -1 if the name is too long
+ */
+static int get_index_name(const char *archive_name, char buf[PATH_MAX]) {
+    if (snprintf(buf, PATH_MAX, "%s%s", archive_name, INDEX_SUFFIX) >= PATH_MAX) {
+        fprintf(stderr, "Archive name %s is too long for an index\n", archive_name);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Writes the members added to 'builder' out as the index of the archive
+ * 'archive_name', stamped with 'archive_stat', the archive's state
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int save_member_index(const char *archive_name, index_builder_t *builder,
+                             const struct stat *archive_stat) {
+    char index_name[PATH_MAX];
+    if (0 != get_index_name(archive_name, index_name)) {
+        return -1;
+    }
+    if (0 != index_builder_write(builder, index_name, archive_stat)) {
+        perror("Failed to write member index");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Adds every member of the archive 'archive_name' to 'builder'. Nothing
+ * records when these members were written, so those with an mtime at or after
+ * 'archive_mtime', the archive's last write, are taken to be racy.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int scan_member_index(const char *archive_name, time_t archive_mtime,
+                             index_builder_t *builder) {
+    int archive_fd = open(archive_name, O_RDONLY);
+    if (-1 == archive_fd) {
+        perror("Failed to open archive file");
+        return -1;
+    }
+    in_stream_t archive;
+    if (0 != in_stream_open(&archive, archive_fd, minitar_options.copy_buf_size)) {
+        perror("Failed to set up archive decompression");
+        close(archive_fd);
+        return -1;
+    }
+
+    builder->racy_from = archive_mtime;
+    archive_member_t member;
+    int result;
+    while ((result = next_archive_member(&archive, &member)) == 1) {
+        if (member.header->typeflag == 'x' || member.header->typeflag == 'g') {
+            continue;
+        }
+        result = index_builder_add(
+            builder, member.name, member.header_offset, member.size,
+            decode_numeric(member.header->mtime, sizeof(member.header->mtime)),
+            decode_numeric(member.header->mode, sizeof(member.header->mode)) & 07777,
+            member.header->typeflag);
+        if (0 != result) {
+            perror("Failed to add member to index");
+            break;
+        }
+    }
+    in_stream_close(&archive);
+    close(archive_fd);
+    return result;
+}
+
+/*
+ * Prepares 'builder' to become the index of the archive 'archive_name' once
+ * members are appended to it. If the index matched 'old_stat', the archive's
+ * state before the append, it is loaded; otherwise the archive is scanned for
+ * its members, but only when --index was given.
+ * Returns 1 if the builder is to be saved after the append, 0 if the archive
+ * keeps no index, or -1 if an error occurs
+ */
+static int start_member_index(const char *archive_name, const struct stat *old_stat,
+                              index_builder_t *builder) {
+    char index_name[PATH_MAX];
+    member_index_t index;
+    if (0 != get_index_name(archive_name, index_name)) {
+        return minitar_options.use_index ? -1 : 0;
+    }
+    if (member_index_open(&index, index_name, old_stat) > 0) {
+        int result = index_builder_load(builder, &index);
+        member_index_close(&index);
+        if (0 == result) {
+            return 1;
+        }
+        index_builder_clear(builder);
+    } else if (!minitar_options.use_index) {
+        return 0;
+    }
+    return 0 == scan_member_index(archive_name, old_stat->st_mtime, builder) ? 1 : -1;
+}
+
+/*
+ * Maps the index of the archive open as 'archive_fd' into 'index' if the
+ * archive has one that is still up to date
+ * Returns 1 if the index was mapped, or 0 if the archive must be scanned
+ */
+static int open_member_index(const char *archive_name, int archive_fd, member_index_t *index) {
+    char index_name[PATH_MAX];
+    struct stat stat_buf;
+    if (0 != get_index_name(archive_name, index_name) || 0 != fstat(archive_fd, &stat_buf)) {
+        return 0;
+    }
+    int result = member_index_open(index, index_name, &stat_buf);
+    if (result < 0) {
+        perror("Failed to read member index, scanning archive instead");
+    } else if (result > 0 && minitar_options.verbose) {
+        fprintf(stderr, "Using member index %s\n", index_name);
+    }
+    return result > 0;
+}
+
+/*
+ * Allocates room in '*fingerprints' for the hash of every entry of 'files'
+ * when --fingerprint is set, or sets it to NULL otherwise
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int alloc_fingerprints(const file_list_t *files, uint64_t **fingerprints) {
+    *fingerprints = NULL;
+    if (minitar_options.fingerprint &&
+        NULL == (*fingerprints = calloc(files->size + 1, sizeof(uint64_t)))) {
+        perror("Failed to allocate fingerprints");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Writes the new archive 'archive_name' holding 'files', as create_archive,
+ * storing the hash of each member's data in 'fingerprints' unless it is NULL.
+ * If 'builder' is not NULL, the members are added to it as they are written
+ * and it is then saved as the archive's index.
+ * Returns 0 on success or 1 if an error occurs
+ */
+static int write_new_archive(const char *archive_name, const file_list_t *files,
+                             uint64_t *fingerprints, index_builder_t *builder) {
+    int archive_fd = open(archive_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (-1 == archive_fd) {
+        perror("Error opening archive file for write");
+        return 1;
+    }
+
+    out_stream_t archive;
+    if (0 != out_stream_open(&archive, archive_fd, minitar_options.compression,
+                             minitar_options.compression_level, minitar_options.copy_buf_size,
+                             minitar_options.num_threads, minitar_options.seekable)) {
+        fprintf(stderr, "Failed to set up archive compression\n");
+        close(archive_fd);
+        return 1;
+    }
+
+    // Attempt to write the files
+    int write_files_result = write_files(&archive, files, NULL, fingerprints, builder);
+    if (0 != write_files_result) {
+        perror("Error writing files");
+        out_stream_close(&archive, 0);
+        return 1;
+    }
+    // Data should have been written, now we need to add the 2 blocks of padding
+    int add_zero_block_result = write_end_blocks(&archive);
+    if (0 != add_zero_block_result) {
+        out_stream_close(&archive, 0);
+        close(archive_fd);
+        return 1;
+    }
+    // Flush whatever the compressor still holds
+    if (0 != out_stream_close(&archive, 1)) {
+        perror("Failure finishing compressed archive");
+        close(archive_fd);
+        return 1;
+    }
+    // The index records the archive as it is once everything is written
+    struct stat stat_buf;
+    if (NULL != builder && 0 != fstat(archive_fd, &stat_buf)) {
+        perror("Failed to stat archive file");
+        close(archive_fd);
+        return 1;
+    }
+    // Close archive fd
+    if (0 != close(archive_fd)) {
+        perror("Failure closing archive file");
+        return 1;
+    }
+
+    if (NULL != builder && 0 != save_member_index(archive_name, builder, &stat_buf)) {
+        return 1;
+    }
+    return 0;
+}
+
+int create_archive(const char *archive_name, const file_list_t *files) {
+    uint64_t *fingerprints;
+    if (0 != alloc_fingerprints(files, &fingerprints)) {
+        return 1;
+    }
+    index_builder_t builder = {0};
+    int result = write_new_archive(archive_name, files, fingerprints,
+                                   minitar_options.use_index ? &builder : NULL);
+    index_builder_clear(&builder);
+    free(fingerprints);
+    return result;
+}
+
+/*
+ * Walks the headers of the uncompressed archive open as 'archive_fd', whose
+ * size is 'archive_size', and stores in 'end' the offset of the first block
+ * that does not start a complete member: a zero block, a header that is cut
+ * short or fails its checksum, or one whose data runs past the end of the
+ * file. Only headers are read, never member data.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int scan_archive_end(int archive_fd, off_t archive_size, off_t *end) {
+    in_stream_t archive;
+    if (0 != in_stream_open(&archive, archive_fd, minitar_options.copy_buf_size)) {
+        perror("Failed to read archive file");
+        return -1;
+    }
+    archive_member_t member;
+    int result = 0;
+    int cut_off = 0;
+    *end = 0;
+    while (*end + BLOCK_SIZE <= archive_size &&
+           (result = read_archive_member(&archive, &member, &cut_off)) == 1 &&
+           header_checksum_ok(member.header) && archive.pos <= archive_size) {
+        *end = archive.pos;
+    }
+    in_stream_close(&archive);
+    return result < 0 ? -1 : 0;
+}
+
+/*
+ * Finds where the members of the uncompressed archive open as 'archive_fd'
+ * end, i.e. where its zero-block trailer starts, storing the offset in 'end'.
+ * 'archive_size' is the archive's size. The last 1024 bytes must be zero.
+ * Normally the trailer is exactly those bytes, which is checked by reading
+ * just the three blocks at the end. Only when the block before them is also
+ * zero (as when another tar padded the archive out to a full record, or the
+ * last member's data ends in a zero block) are the headers scanned.
+ * Returns 0 on success or -1 if an error occurs or the trailer is missing
+ */
+static int find_archive_end(int archive_fd, off_t archive_size, off_t *end) {
+    char tail[3 * BLOCK_SIZE];
+    if (archive_size == 0) {
+        *end = 0;    // An empty file is an empty archive
+        return 0;
+    }
+    size_t tail_size = archive_size >= sizeof(tail) ? sizeof(tail) : 2 * BLOCK_SIZE;
+    if (archive_size % BLOCK_SIZE != 0 || archive_size < 2 * BLOCK_SIZE ||
+        tail_size != pread(archive_fd, tail, tail_size, archive_size - tail_size) ||
+        !is_zero_block(tail + tail_size - 2 * BLOCK_SIZE) ||
+        !is_zero_block(tail + tail_size - BLOCK_SIZE)) {
+        fprintf(stderr, "Archive does not end with a zero-block trailer\n");
+        return -1;
+    }
+    *end = archive_size - 2 * BLOCK_SIZE;
+    if (tail_size == 2 * BLOCK_SIZE || !is_zero_block(tail)) {
+        return 0;
+    }
+    return scan_archive_end(archive_fd, archive_size, end);
+}
+
+/*
+ * Finds the end of the members of the uncompressed archive open as
+ * 'archive_fd' like find_archive_end, but without trusting the end of the
+ * file: an interrupted append may have left partial members, or whole
+ * members that were never committed, after the first zero block. Anything
+ * there is cut off and a fresh trailer written at the end found, so the
+ * archive again ends exactly in two zero blocks.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int recover_archive_end(int archive_fd, off_t archive_size, off_t *end) {
+    char trailer[2 * BLOCK_SIZE] = {0};
+    char tail[2 * BLOCK_SIZE];
+    if (0 != scan_archive_end(archive_fd, archive_size, end)) {
+        return -1;
+    }
+    if (archive_size == *end + sizeof(tail) &&
+        sizeof(tail) == pread(archive_fd, tail, sizeof(tail), *end) &&
+        0 == memcmp(tail, trailer, sizeof(tail))) {
+        return 0;    // Already ends cleanly
+    }
+    if (sizeof(trailer) != pwrite(archive_fd, trailer, sizeof(trailer), *end) ||
+        0 != ftruncate(archive_fd, *end + sizeof(trailer)) || 0 != fdatasync(archive_fd)) {
+        perror("Failed to repair end of archive file");
+        return -1;
+    }
+    if (minitar_options.verbose) {
+        fprintf(stderr, "Recovered archive: trimmed torn tail after offset %lld\n",
+                (long long) *end);
+    }
+    return 0;
+}
+
+/*
+ * Appends 'files' to the archive open as 'archive_fd' so that a crash at any
+ * point leaves either the old archive or the complete new one. Everything but
+ * the first new header is written after the old trailer's first block, which
+ * stays zero and so keeps hiding the new data from readers; once that data
+ * and the new trailer are on disk, the first header is written over the old
+ * trailer as the single commit point. The archive must end exactly at
+ * 'end' + 1024, as left by recover_archive_end. The new members are added to
+ * 'builder' unless it is NULL.
+ * Closes the archive fd on error.
+ * Returns 0 on success or 1 if an error occurs
+ */
+static int durable_append(int archive_fd, off_t end, const file_list_t *files,
+                          uint64_t *fingerprints, index_builder_t *builder) {
+    // With no members there is no first header to commit, and the trailer
+    // left by recover_archive_end already ends the archive
+    if (0 == files->size) {
+        return 0;
+    }
+    if (-1 == lseek(archive_fd, end, SEEK_SET)) {
+        perror("Failure seeking archive file");
+        close(archive_fd);
+        return 1;
+    }
+    out_stream_t archive;
+    if (0 != out_stream_open(&archive, archive_fd, COMPRESS_NONE, 0, 0, 1, 0)) {
+        close(archive_fd);
+        return 1;
+    }
+    tar_header first_header;
+    if (0 != write_files(&archive, files, &first_header, fingerprints, builder)) {
+        perror("Error writing files");
+        out_stream_close(&archive, 0);
+        return 1;
+    }
+    int end_result = write_end_blocks(&archive);
+    out_stream_close(&archive, 0);
+    if (0 != end_result) {
+        close(archive_fd);
+        return 1;
+    }
+    if (0 != fdatasync(archive_fd)) {
+        perror("Failed to flush appended members");
+        close(archive_fd);
+        return 1;
+    }
+    if (sizeof(tar_header) != pwrite(archive_fd, &first_header, sizeof(tar_header), end) ||
+        0 != fdatasync(archive_fd)) {
+        perror("Failed to commit appended members");
+        close(archive_fd);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Appends 'files' to the archive open as 'archive_fd' by writing them, and a
+ * new trailer, over the old trailer at 'end'. The new members are added to
+ * 'builder' unless it is NULL.
+ * Closes the archive fd on error.
+ * Returns 0 on success or 1 if an error occurs
+ */
+static int trailer_append(int archive_fd, off_t end, const file_list_t *files,
+                          uint64_t *fingerprints, index_builder_t *builder) {
+    if (-1 == lseek(archive_fd, end, SEEK_SET)) {
+        perror("Failure seeking archive file");
+        close(archive_fd);
+        return 1;
+    }
+
+    // Appended members are never compressed, matching the archive
+    out_stream_t archive;
+    if (0 != out_stream_open(&archive, archive_fd, COMPRESS_NONE, 0, 0, 1, 0)) {
+        close(archive_fd);
+        return 1;
+    }
+
+    // Do the adding of files
+    if (0 != write_files(&archive, files, NULL, fingerprints, builder)) {
+        perror("Error writing files");
+        out_stream_close(&archive, 0);
+        return 1;
+    }
+
+    // Now add new footer
+    int end_result = write_end_blocks(&archive);
+    out_stream_close(&archive, 0);
+    if (0 != end_result) {
+        close(archive_fd);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Appends 'files' to the archive 'archive_name', as append_files_to_archive,
+ * storing the hash of each member's data in 'fingerprints' unless it is NULL
+ * Returns 0 on success or 1 if an error occurs
+ */
+static int append_members(const char *archive_name, const file_list_t *files,
+                          uint64_t *fingerprints) {
+    // The archive is opened once; everything below works on this descriptor
+    int archive_fd = open(archive_name, O_RDWR);
+    if (-1 == archive_fd) {
+        perror("Failure opening archive file");
+        return 1;
+    }
+
+    // Note the archive's state now, so that an index that is up to date can
+    // later be extended with just the new members
+    struct stat old_stat;
+    if (0 != fstat(archive_fd, &old_stat)) {
+        perror("Failed to stat archive file");
+        close(archive_fd);
+        return 1;
+    }
+
+    // The trailer of a compressed archive is inside its compressed data, so
+    // there is nothing to write over
+    unsigned char magic[4];
+    ssize_t magic_len = pread(archive_fd, magic, sizeof(magic), 0);
+    if (magic_len > 0 && COMPRESS_NONE != detect_compression(magic, magic_len)) {
+        fprintf(stderr, "Cannot append to a compressed archive\n");
+        close(archive_fd);
+        return 1;
+    }
+
+    // New members go over the old trailer. Without --durable the first header
+    // lands on it straight away, so an append that fails part way leaves the
+    // members written so far and no trailer; only durable_append holds that
+    // header back until everything after it is on disk
+    off_t end;
+    if (minitar_options.durable) {
+        if (0 != recover_archive_end(archive_fd, old_stat.st_size, &end) ||
+            0 != fstat(archive_fd, &old_stat)) {
+            close(archive_fd);
+            return 1;
+        }
+    } else if (0 != find_archive_end(archive_fd, old_stat.st_size, &end)) {
+        close(archive_fd);
+        return 1;
+    }
+
+    // An index the archive keeps is extended as the new members are written
+    index_builder_t builder = {0};
+    int keep_index = start_member_index(archive_name, &old_stat, &builder);
+    if (keep_index < 0) {
+        index_builder_clear(&builder);
+        close(archive_fd);
+        return 1;
+    }
+    index_builder_t *builder_ptr = keep_index ? &builder : NULL;
+    int result;
+    if (minitar_options.durable) {
+        result = durable_append(archive_fd, end, files, fingerprints, builder_ptr);
+    } else {
+        result = trailer_append(archive_fd, end, files, fingerprints, builder_ptr);
+    }
+    if (0 != result) {
+        index_builder_clear(&builder);
+        return 1;
+    }
+
+    struct stat new_stat;
+    if (keep_index && 0 != fstat(archive_fd, &new_stat)) {
+        perror("Failed to stat archive file");
+        result = 1;
+    }
+    // Close archive fd
+    if (0 != close(archive_fd)) {
+        perror("Failure closing archive file");
+        result = 1;
+    }
+    if (0 == result && keep_index && 0 != save_member_index(archive_name, &builder, &new_stat)) {
+        result = 1;
+    }
+    index_builder_clear(&builder);
+    return result;
+}
+
+int append_files_to_archive(const char *archive_name, const file_list_t *files) {
+    uint64_t *fingerprints;
+    if (0 != alloc_fingerprints(files, &fingerprints)) {
+        return 1;
+    }
+    int result = append_members(archive_name, files, fingerprints);
+    free(fingerprints);
+    return result;
+}
+
+/*
+ * Copies the full path of the member described by 'header' into 'name',
+ * joining the ustar prefix and name fields, neither of which needs to be
+ * null-terminated when full.
+ */
+void get_member_name(const tar_header *header, char name[MAX_MEMBER_NAME_LEN]) {
+    size_t prefix_len = strnlen(header->prefix, sizeof(header->prefix));
+    size_t name_len = strnlen(header->name, sizeof(header->name));
+    size_t pos = 0;
+    if (prefix_len > 0) {
+        memcpy(name, header->prefix, prefix_len);
+        name[prefix_len] = '/';
+        pos = prefix_len + 1;
+    }
+    memcpy(name + pos, header->name, name_len);
+    name[pos + name_len] = '\0';
+}
+
+/*
+ * Returns nonzero if every byte of the 512-byte block 'block' is zero
+ */
+static int is_zero_block(const char *block) {
+    for (int i = 0; i < BLOCK_SIZE; i++) {
+        if (block[i] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Reads the header at the current position of 'archive' into 'member', then
+ * skips over that member's data blocks so the stream is left at the next
+ * header. Member data is never copied out. A mapped archive's headers are not
+ * copied either: 'member' gets a view into the mapping, so scanning costs no
+ * system calls at all. Other uncompressed archives cost one block read per
+ * member regardless of member size; a compressed one still has to be
+ * decompressed in full (or, if seekable, the frames holding headers).
+ * If 'cut_off' is not NULL, a member whose data runs past the end of the
+ * archive is not an error: '*cut_off' is set and 0 is returned instead.
+ * Returns 1 if a member was read, 0 once the zero-block trailer is reached
+ * (or at once, for an empty file), or -1 if an error occurs, which includes
+ * an archive cut off before its trailer
+ */
+static int read_archive_member(in_stream_t *archive, archive_member_t *member, int *cut_off) {
+    member->header_offset = archive->pos;
+
+    ssize_t bytes_read = in_stream_read_view(archive, sizeof(tar_header), &member->header_buf,
+                                             (const void **) &member->header);
+    if (bytes_read < 0) {
+        perror("Failed to read header from archive file");
+        return -1;
+    } else if (bytes_read == 0 && member->header_offset == 0) {
+        // An empty file is an empty archive
+        return 0;
+    } else if (bytes_read == 0) {
+        fprintf(stderr, "Archive file ends without an end-of-archive block\n");
+        return -1;
+    } else if (bytes_read != sizeof(tar_header)) {
+        fprintf(stderr, "Archive file ends in the middle of a header\n");
+        return -1;
+    }
+    // write_end_blocks emits two zero blocks; like tar, stop at the first one
+    if (is_zero_block((const char *) member->header)) {
+        return 0;
+    }
+
+    switch (member->header->typeflag) {
+        case '1':    // Hard link
+        case '2':    // Symbolic link
+        case '3':    // Character device
+        case '4':    // Block device
+        case DIRTYPE:
+        case '6':    // FIFO
+            // Size field does not describe any data blocks for these types
+            member->size = 0;
+            break;
+        default:
+            member->size = decode_numeric(member->header->size, sizeof(member->header->size));
+    }
+    get_member_name(member->header, member->name);
+
+    off_t data_blocks = (member->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int seek_result = in_stream_seek(archive, archive->pos + data_blocks * BLOCK_SIZE);
+    if (seek_result < 0) {
+        perror("Failed to seek past member in archive file");
+        return -1;
+    } else if (seek_result > 0 && NULL != cut_off) {
+        *cut_off = 1;
+        return 0;
+    } else if (seek_result > 0) {
+        fprintf(stderr, "Archive file ends in the middle of member %s\n", member->name);
+        return -1;
+    }
+    return 1;
+}
+
+/*
+ * Reads the next member of 'archive' as read_archive_member does, with a
+ * member cut off by the end of the archive counting as an error
+ * Returns 1 if a member was read, 0 at the trailer, or -1 if an error occurs
+ */
+int next_archive_member(in_stream_t *archive, archive_member_t *member) {
+    return read_archive_member(archive, member, NULL);
+}
+
+int get_archive_file_list(const char *archive_name, file_list_t *files) {
+    int archive_fd = open(archive_name, O_RDONLY);
+    if (-1 == archive_fd) {
+        perror("Failed to open archive file");
+        return -1;
+    }
+
+    member_index_t index;
+    if (open_member_index(archive_name, archive_fd, &index)) {
+        int result = 0;
+        for (uint64_t i = 0; i < index.header->num_entries && 0 == result; i++) {
+            const char *name = member_index_name(&index, &index.entries[i]);
+            if (NULL == name || 0 != file_list_add(files, name)) {
+                fprintf(stderr, "Failed to add name from member index to file list\n");
+                result = -1;
+            }
+        }
+        member_index_close(&index);
+        close(archive_fd);
+        return result;
+    }
+
+    in_stream_t archive;
+    if (0 != in_stream_open(&archive, archive_fd, minitar_options.copy_buf_size)) {
+        perror("Failed to set up archive decompression");
+        close(archive_fd);
+        return -1;
+    }
+
+    archive_member_t member;
+    int result;
+    while ((result = next_archive_member(&archive, &member)) == 1) {
+        if (0 != verify_member_header(&member)) {
+            result = -1;
+            break;
+        }
+        // Extended headers describe the following member rather than being members
+        if (member.header->typeflag == 'x' || member.header->typeflag == 'g') {
+            continue;
+        }
+        if (0 != file_list_add(files, member.name)) {
+            perror("Failed to add name to file list");
+            result = -1;
+            break;
+        }
+    }
+
+    in_stream_close(&archive);
+    if (0 != close(archive_fd)) {
+        perror("Failure closing archive file");
+        return -1;
+    }
+    return result;
+}
+
+/*
+ * Appends a record of a member named 'name' with the given header offset,
+ * size, permission bits, mtime and type to 'table', growing it as needed
+ * Returns 0 on success or -1 if an error occurs
+ */
+int member_table_append(member_table_t *table, const char *name, off_t header_offset,
+                        size_t size, mode_t mode, time_t mtime, char typeflag) {
+    if (table->count == table->capacity) {
+        size_t new_capacity = table->capacity == 0 ? 64 : table->capacity * 2;
+        member_entry_t *entries = realloc(table->entries, new_capacity * sizeof(member_entry_t));
+        if (NULL == entries) {
+            return -1;
+        }
+        table->entries = entries;
+        table->capacity = new_capacity;
+    }
+
+    member_entry_t *entry = &table->entries[table->count];
+    entry->name = strdup(name);
+    if (NULL == entry->name) {
+        return -1;
+    }
+    entry->header_offset = header_offset;
+    entry->size = size;
+    entry->mode = mode;
+    entry->mtime = mtime;
+    entry->typeflag = typeflag;
+    entry->latest = 0;
+    table->count++;
+    return 0;
+}
+
+/*
+ * Appends a compact record of 'member' to 'table', growing it as needed
+ * Returns 0 on success or -1 if an error occurs
+ */
+int member_table_add(member_table_t *table, const archive_member_t *member) {
+    return member_table_append(
+        table, member->name, member->header_offset, member->size,
+        decode_numeric(member->header->mode, sizeof(member->header->mode)) & 07777,
+        decode_numeric(member->header->mtime, sizeof(member->header->mtime)),
+        member->header->typeflag);
+}
+
+// qsort comparison putting index entries in archive order
+static int compare_index_entries(const void *a, const void *b) {
+    const index_entry_t *entry_a = *(const index_entry_t *const *) a;
+    const index_entry_t *entry_b = *(const index_entry_t *const *) b;
+    return (entry_a > entry_b) - (entry_a < entry_b);
+}
+
+/*
+ * Adds members from the archive's member index to 'table' instead of scanning
+ * the archive: every member if 'names' is NULL, or otherwise only the latest
+ * version of each named member, found with one hash probe per name. Entries
+ * are added in archive order, with the index's 'latest' flags.
+ * Returns 0 on success or -1 if an error occurs or a name is not in the index
+ */
+static int load_members_from_index(const member_index_t *index, const file_list_t *names,
+                                   member_table_t *table) {
+    size_t num_selected = index->header->num_entries;
+    const index_entry_t **selected = NULL;
+    if (NULL != names) {
+        selected = malloc((names->size + 1) * sizeof(index_entry_t *));
+        if (NULL == selected) {
+            perror("Failed to allocate member selection");
+            return -1;
+        }
+        num_selected = 0;
+        for (int i = 0; i < names->size; i++) {
+            const index_entry_t *entry = member_index_lookup(index, names->entries[i].name);
+            if (NULL == entry) {
+                fprintf(stderr, "Member %s not found in archive\n", names->entries[i].name);
+                free(selected);
+                return -1;
+            }
+            selected[num_selected++] = entry;
+        }
+        // Entries are stored in archive order, so their addresses sort the same way
+        qsort(selected, num_selected, sizeof(index_entry_t *), compare_index_entries);
+    }
+
+    for (size_t i = 0; i < num_selected; i++) {
+        const index_entry_t *entry = NULL == selected ? &index->entries[i] : selected[i];
+        if (i > 0 && NULL != selected && entry == selected[i - 1]) {
+            continue;    // Named twice
+        }
+        const char *name = member_index_name(index, entry);
+        if (NULL == name || 0 != member_table_append(table, name, entry->header_offset,
+                                                     entry->size, entry->mode, entry->mtime,
+                                                     entry->typeflag)) {
+            fprintf(stderr, "Failed to load member from index\n");
+            free(selected);
+            return -1;
+        }
+        table->entries[table->count - 1].latest = entry->latest;
+    }
+    free(selected);
+    return 0;
+}
+
+// Free all memory held by 'table' and leave it empty
+void member_table_clear(member_table_t *table) {
+    for (size_t i = 0; i < table->count; i++) {
+        free(table->entries[i].name);
+    }
+    free(table->entries);
+    table->entries = NULL;
+    table->count = 0;
+    table->capacity = 0;
+}
+
+/*
+ * Scans the headers of 'archive' from its current position, adding every real
+ * member to 'table'. Extended headers are skipped, and every header's checksum
+ * is verified.
+ * Returns 0 on success or -1 if an error occurs
+ */
+int scan_archive_members(in_stream_t *archive, member_table_t *table) {
+    archive_member_t member;
+    int result;
+    while ((result = next_archive_member(archive, &member)) == 1) {
+        if (0 != verify_member_header(&member)) {
+            return -1;
+        }
+        if (member.header->typeflag == 'x' || member.header->typeflag == 'g') {
+            continue;
+        }
+        if (0 != member_table_add(table, &member)) {
+            perror("Failed to record archive member");
+            return -1;
+        }
+    }
+    return result;
+}
+
+/*
+ * Sets the 'latest' flag on exactly one entry per distinct name in 'table':
+ * the one that appears last in the archive, i.e. the most recently added.
+ * Uses an open-addressing map from name to entry index, so resolving all
+ * versions takes a single pass over the table.
+ * Returns 0 on success or -1 if an error occurs
+ */
+int mark_latest_versions(member_table_t *table) {
+    size_t num_slots = 16;
+    while (num_slots < table->count * 2) {
+        num_slots *= 2;
+    }
+    size_t *slots = malloc(num_slots * sizeof(size_t));
+    if (NULL == slots) {
+        perror("Failed to allocate member map");
+        return -1;
+    }
+    // Slots hold entry index + 1 so that 0 can mean empty
+    memset(slots, 0, num_slots * sizeof(size_t));
+
+    for (size_t i = 0; i < table->count; i++) {
+        size_t slot = file_list_hash(table->entries[i].name) & (num_slots - 1);
+        while (slots[slot] != 0 &&
+               strcmp(table->entries[slots[slot] - 1].name, table->entries[i].name) != 0) {
+            slot = (slot + 1) & (num_slots - 1);
+        }
+        // Later versions overwrite earlier ones
+        slots[slot] = i + 1;
+    }
+    for (size_t slot = 0; slot < num_slots; slot++) {
+        if (slots[slot] != 0) {
+            table->entries[slots[slot] - 1].latest = 1;
+        }
+    }
+
+    free(slots);
+    return 0;
+}
+
+/*
+ * Creates any missing parent directories of the path 'name'. A trailing '/',
+ * as directory members have, does not make 'name' its own parent.
+ * Returns 0 on success or -1 if an error occurs
+ */
+int make_parent_dirs(const char *name) {
+    char path[MAX_MEMBER_NAME_LEN];
+    strncpy(path, name, MAX_MEMBER_NAME_LEN - 1);
+    path[MAX_MEMBER_NAME_LEN - 1] = '\0';
+    for (char *slash = strchr(path + 1, '/'); slash != NULL && slash[1] != '\0';
+         slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (0 != mkdir(path, 0755) && errno != EEXIST) {
+            return -1;
+        }
+        *slash = '/';
+    }
+    return 0;
+}
+
+/*
+ * Returns nonzero if 'name' could write outside the current directory, i.e.
+ * it is absolute or has a ".." component
+ */
+static int is_unsafe_name(const char *name) {
+    if (name[0] == '/') {
+        return 1;
+    }
+    for (const char *part = name; part != NULL; part = strchr(part, '/')) {
+        if (*part == '/') {
+            part++;
+        }
+        if (strncmp(part, "..", 2) == 0 && (part[2] == '/' || part[2] == '\0')) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Copies up to 'limit' bytes from the current position of the compressed
+ * 'archive' to 'out_fd' through 'buf', which holds 'buf_size' bytes.
+ * Stores the number of bytes copied in 'copied'.
+ * Returns 0 on success or -1 if an error occurs
+ */
+int copy_stream_bytes(in_stream_t *archive, int out_fd, size_t limit, char *buf,
+                      size_t buf_size, size_t *copied) {
+    *copied = 0;
+    while (*copied < limit) {
+        size_t chunk = limit - *copied < buf_size ? limit - *copied : buf_size;
+        ssize_t bytes_read = in_stream_read(archive, buf, chunk);
+        if (bytes_read < 0) {
+            return -1;
+        } else if (bytes_read == 0) {
+            break;
+        } else if (0 != write_all(out_fd, buf, bytes_read)) {
+            perror("Failure writing file data");
+            return -1;
+        }
+        *copied += bytes_read;
+    }
+    return 0;
+}
+
+// Permission bits masked off extracted files, read once per extraction
+static mode_t extract_umask;
+
+// Output file being written for one member before it is put in place
+typedef struct {
+    int fd;
+    // Temporary name the file was created under, or empty if it has none
+    // (O_TMPFILE) until it is linked in
+    char temp_name[MAX_MEMBER_NAME_LEN + 32];
+} output_file_t;
+
+/*
+ * Stores the directory part of 'name' in 'dir', or "." if it has none
+ */
+static void get_parent_dir(const char *name, char dir[MAX_MEMBER_NAME_LEN]) {
+    const char *slash = strrchr(name, '/');
+    if (NULL == slash) {
+        strcpy(dir, ".");
+    } else if (slash == name) {
+        strcpy(dir, "/");
+    } else {
+        memcpy(dir, name, slash - name);
+        dir[slash - name] = '\0';
+    }
+}
+
+/*
+ * Stores a name next to 'name' in 'temp_name' that no other output of this
+ * process uses
+ */
+static void make_temp_name(const char *name, char temp_name[MAX_MEMBER_NAME_LEN + 32]) {
+    static unsigned counter;
+    unsigned id = __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED);
+    snprintf(temp_name, MAX_MEMBER_NAME_LEN + 32, "%s.minitar-%d-%u", name, (int) getpid(), id);
+}
+
+/*
+ * Reserves 'size' bytes of disk space for the output file 'fd' in one
+ * allocation. Filesystems that cannot preallocate are left to allocate as
+ * the data is written.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int preallocate_output(int fd, size_t size) {
+    if (size > 0 && 0 != fallocate(fd, 0, 0, size) && errno != EOPNOTSUPP && errno != ENOSYS) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Closes the output file 'out' and removes it, for a member that failed
+ */
+static void discard_output(output_file_t *out) {
+    close(out->fd);
+    if ('\0' != out->temp_name[0]) {
+        unlink(out->temp_name);
+    }
+}
+
+/*
+ * Creates the output file for the member described by 'entry' in 'out',
+ * creating its parent directories if needed, and preallocates its full size.
+ * The file is created unnamed with O_TMPFILE in the directory it belongs in,
+ * or under a temporary name where the filesystem does not support that, so
+ * nothing appears under the member's name until commit_output.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int open_output(const member_entry_t *entry, output_file_t *out) {
+    char dir[MAX_MEMBER_NAME_LEN];
+    get_parent_dir(entry->name, dir);
+    out->temp_name[0] = '\0';
+    out->fd = open(dir, O_TMPFILE | O_WRONLY, 0600);
+    if (-1 == out->fd && errno == ENOENT && 0 == make_parent_dirs(entry->name)) {
+        out->fd = open(dir, O_TMPFILE | O_WRONLY, 0600);
+    }
+    if (-1 == out->fd && (errno == EOPNOTSUPP || errno == EISDIR || errno == EINVAL)) {
+        make_temp_name(entry->name, out->temp_name);
+        out->fd = open(out->temp_name, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    }
+    if (-1 == out->fd) {
+        return -1;
+    }
+    if (0 != preallocate_output(out->fd, entry->size)) {
+        int err = errno;
+        discard_output(out);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Gives the unnamed file open as 'fd' the name 'name', which must not exist
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int link_unnamed_file(int fd, const char *name) {
+    if (0 == linkat(fd, "", AT_FDCWD, name, AT_EMPTY_PATH)) {
+        return 0;
+    }
+    if (errno != ENOENT && errno != EPERM) {
+        return -1;
+    }
+    // Without CAP_DAC_READ_SEARCH, go through the descriptor's /proc entry
+    char proc_path[64];
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+    return linkat(AT_FDCWD, proc_path, AT_FDCWD, name, AT_SYMLINK_FOLLOW);
+}
+
+/*
+ * Finishes the fully written output file 'out' for the member described by
+ * 'entry': sets its mode and mtime through the descriptor, then puts it in
+ * place under the member's name in a single step, replacing any existing
+ * file atomically, and closes it. On failure the output is discarded.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int commit_output(output_file_t *out, const member_entry_t *entry) {
+    struct timespec times[2] = {
+        {.tv_nsec = UTIME_OMIT},
+        {.tv_sec = entry->mtime},
+    };
+    if (0 != fchmod(out->fd, entry->mode & ~extract_umask) || 0 != futimens(out->fd, times)) {
+        goto fail;
+    }
+    if ('\0' == out->temp_name[0]) {
+        if (0 == link_unnamed_file(out->fd, entry->name)) {
+            return close(out->fd);
+        }
+        if (errno != EEXIST) {
+            goto fail;
+        }
+        // An existing file is replaced by linking under a temporary name first
+        make_temp_name(entry->name, out->temp_name);
+        if (0 != link_unnamed_file(out->fd, out->temp_name)) {
+            out->temp_name[0] = '\0';
+            goto fail;
+        }
+    }
+    if (0 != rename(out->temp_name, entry->name)) {
+        goto fail;
+    }
+    return close(out->fd);
+
+fail:;
+    int err = errno;
+    discard_output(out);
+    errno = err;
+    return -1;
+}
+
+/*
+ * Writes the member described by 'entry' out of 'archive' into the current
+ * working directory. Data is copied with copy_bytes straight from the archive
+ * fd when the archive is uncompressed, or with copy_stream_bytes otherwise.
+ * When only the read/write method works and the archive is mapped, the data
+ * is written directly from the mapping instead. The output file only
+ * appears under the member's name once complete, with its mode and mtime
+ * already set (see open_output and commit_output). An uncompressed archive is
+ * only read at explicit offsets, never through its file position, so several
+ * threads may extract from it at once given their own 'method' and 'buf'.
+ * Returns 0 on success or -1 if an error occurs
+ */
+int extract_member(in_stream_t *archive, const member_entry_t *entry, copy_method_t *method,
+                   char *buf, size_t buf_size) {
+    char err_msg[MAX_MSG_LEN];
+
+    if (is_unsafe_name(entry->name)) {
+        fprintf(stderr, "Skipping member with unsafe name %s\n", entry->name);
+        return 0;
+    }
+
+    // Directories stay writable by their owner until finish_directories gives
+    // them their own mode, so members can still be extracted into them
+    if (entry->typeflag == DIRTYPE) {
+        if (0 != make_parent_dirs(entry->name) ||
+            (0 != mkdir(entry->name, entry->mode | S_IRWXU) && errno != EEXIST)) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to create directory %s", entry->name);
+            perror(err_msg);
+            return -1;
+        }
+        return 0;
+    }
+    // Only regular files ('0', or '\0' from old archives, or contiguous '7') carry data
+    if (entry->typeflag != REGTYPE && entry->typeflag != '\0' && entry->typeflag != '7') {
+        fprintf(stderr, "Skipping member %s of unsupported type '%c'\n", entry->name,
+                entry->typeflag);
+        return 0;
+    }
+
+    output_file_t out;
+    if (0 != open_output(entry, &out)) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to create file %s", entry->name);
+        perror(err_msg);
+        return -1;
+    }
+    int out_fd = out.fd;
+
+    size_t copied;
+    off_t data_offset = entry->header_offset + BLOCK_SIZE;
+    int copy_result = 0;
+    if (NULL != archive->map && *method == COPY_READ_WRITE) {
+        // No in-kernel copy works here, but the data can be written straight
+        // out of the mapping rather than read into 'buf' first
+        size_t available = data_offset < archive->map_size ? archive->map_size - data_offset : 0;
+        copied = entry->size < available ? entry->size : available;
+        if (0 != write_all(out_fd, archive->map + data_offset, copied)) {
+            perror("Failure writing file data");
+            copy_result = -1;
+        }
+    } else if (archive->compression == COMPRESS_NONE) {
+        copy_result = copy_bytes(archive->fd, &data_offset, out_fd, entry->size, method, buf,
+                                 buf_size, &copied, NULL);
+    } else {
+        copy_result = in_stream_seek(archive, data_offset);
+        if (0 == copy_result) {
+            copy_result = copy_stream_bytes(archive, out_fd, entry->size, buf, buf_size,
+                                            &copied);
+        }
+    }
+    if (0 != copy_result) {
+        discard_output(&out);
+        return -1;
+    }
+    if (copied != entry->size) {
+        fprintf(stderr, "Archive file ends in the middle of member %s\n", entry->name);
+        discard_output(&out);
+        return -1;
+    }
+
+    if (0 != commit_output(&out, entry)) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to finish file %s", entry->name);
+        perror(err_msg);
+        return -1;
+    }
+    return 0;
+}
+
+// Winning members queued for one io_uring extraction batch
+typedef struct {
+    uring_t *ring;
+    in_stream_t *archive;
+    const member_entry_t *entries[URING_BATCH];
+    // Directory each member's output file is created in
+    char dirs[URING_BATCH][MAX_MEMBER_NAME_LEN];
+    // Where each member's data is staged, and the bytes of staging used so far
+    size_t offsets[URING_BATCH];
+    int count;
+    size_t used;
+    char *staging;
+    // Buffer and copy method for members that fall back to extract_member
+    char *buf;
+    size_t buf_size;
+    copy_method_t method;
+} extract_batch_t;
+
+/*
+ * Extracts every member queued in 'batch' and empties it. All output files
+ * are created (unnamed, with O_TMPFILE) and all member data read from the
+ * archive in one submission; after each file is preallocated, all the data
+ * is written in a second submission, and each file is then put in place with
+ * commit_output. Members whose output file could not be created this way
+ * (for instance because a parent directory is missing, or the filesystem
+ * lacks O_TMPFILE) are retried with extract_member.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int flush_extract_batch(extract_batch_t *batch) {
+    output_file_t outs[URING_BATCH];
+    int results[URING_BATCH * 2];
+    int count = batch->count;
+    int result = 0;
+    batch->count = 0;
+    batch->used = 0;
+    if (count == 0) {
+        return 0;
+    }
+
+    for (int j = 0; j < count; j++) {
+        const member_entry_t *entry = batch->entries[j];
+        get_parent_dir(entry->name, batch->dirs[j]);
+        struct io_uring_sqe *sqe = uring_get_sqe(batch->ring);
+        uring_prep_openat(sqe, AT_FDCWD, batch->dirs[j], O_TMPFILE | O_WRONLY, 0600);
+        sqe->user_data = 2 * j;
+        sqe = uring_get_sqe(batch->ring);
+        uring_prep_read(sqe, batch->archive->fd, batch->staging + batch->offsets[j], entry->size,
+                        entry->header_offset + BLOCK_SIZE);
+        sqe->user_data = 2 * j + 1;
+    }
+    if (0 != uring_run(batch->ring, results, 2 * count)) {
+        perror("Failed to submit io_uring operations");
+        return -1;
+    }
+
+    for (int j = 0; j < count; j++) {
+        outs[j].fd = results[2 * j];
+        outs[j].temp_name[0] = '\0';
+        // Finish any short read synchronously; only a read that finds the end
+        // of the archive before the member's data does means it was cut off
+        const member_entry_t *entry = batch->entries[j];
+        int bytes_read = results[2 * j + 1];
+        if (bytes_read < 0 && result == 0) {
+            errno = -bytes_read;
+            perror("Failure reading archive file");
+            result = -1;
+        }
+        size_t done = bytes_read < 0 ? 0 : bytes_read;
+        while (result == 0 && done < entry->size) {
+            ssize_t more = pread(batch->archive->fd, batch->staging + batch->offsets[j] + done,
+                                 entry->size - done, entry->header_offset + BLOCK_SIZE + done);
+            if (more < 0 && errno == EINTR) {
+                continue;
+            }
+            if (more < 0) {
+                perror("Failure reading archive file");
+                result = -1;
+            } else if (more == 0) {
+                fprintf(stderr, "Archive file ends in the middle of member %s\n", entry->name);
+                result = -1;
+            }
+            done += more > 0 ? more : 0;
+        }
+        if (outs[j].fd >= 0 && result == 0 &&
+            0 != preallocate_output(outs[j].fd, batch->entries[j]->size)) {
+            perror("Failed to allocate space for extracted file");
+            result = -1;
+        }
+    }
+
+    for (int j = 0; j < count && result == 0; j++) {
+        if (outs[j].fd < 0) {
+            continue;
+        }
+        struct io_uring_sqe *sqe = uring_get_sqe(batch->ring);
+        uring_prep_write(sqe, outs[j].fd, batch->staging + batch->offsets[j],
+                         batch->entries[j]->size, 0);
+        sqe->user_data = j;
+    }
+    if (result == 0 && 0 != uring_run(batch->ring, results, count)) {
+        perror("Failed to submit io_uring operations");
+        result = -1;
+    }
+
+    for (int j = 0; j < count; j++) {
+        if (outs[j].fd < 0) {
+            // Fall back for outputs that could not be created directly
+            if (result == 0) {
+                result = extract_member(batch->archive, batch->entries[j], &batch->method,
+                                        batch->buf, batch->buf_size);
+            }
+            continue;
+        }
+        if (result != 0) {
+            discard_output(&outs[j]);
+            continue;
+        }
+        // Finish any short write synchronously
+        int written = results[j];
+        if (written < 0) {
+            errno = -written;
+        }
+        size_t done = written < 0 ? 0 : written;
+        while (written > 0 && done < batch->entries[j]->size) {
+            written = pwrite(outs[j].fd, batch->staging + batch->offsets[j] + done,
+                             batch->entries[j]->size - done, done);
+            done += written > 0 ? written : 0;
+        }
+        // A write that makes no progress is a failure, not something to retry
+        if (written == 0 && done < batch->entries[j]->size) {
+            errno = EIO;
+        }
+        int failed = done < batch->entries[j]->size;
+        if (failed) {
+            discard_output(&outs[j]);
+        }
+        if (failed || 0 != commit_output(&outs[j], batch->entries[j])) {
+            char err_msg[MAX_MSG_LEN];
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to write file %s", batch->entries[j]->name);
+            perror(err_msg);
+            result = -1;
+        }
+    }
+    return result;
+}
+
+/*
+ * io_uring version of extraction's second phase, used with --io-uring. Winning
+ * regular files are queued in batches of up to URING_BATCH members whose data
+ * fits in a staging buffer together. Directories, other member types and
+ * members too large to stage are extracted synchronously with extract_member,
+ * after flushing the current batch so members are still created in archive
+ * order.
+ * Returns 0 on success or -1 if an error occurs
+ */
+int extract_members_uring(uring_t *ring, in_stream_t *archive, const member_table_t *table,
+                          size_t *num_extracted) {
+    extract_batch_t batch = {
+        .ring = ring,
+        .archive = archive,
+        .buf_size = minitar_options.copy_buf_size,
+        .method = COPY_FILE_RANGE,
+    };
+    size_t staging_size = batch.buf_size * URING_STAGING_BUFS;
+    batch.buf = alloc_copy_buffer(batch.buf_size);
+    batch.staging = alloc_copy_buffer(staging_size);
+    if (NULL == batch.buf || NULL == batch.staging) {
+        perror("Failed to set up io_uring buffers");
+        free(batch.buf);
+        free(batch.staging);
+        return -1;
+    }
+
+    int result = 0;
+    for (size_t i = 0; i < table->count && result == 0; i++) {
+        const member_entry_t *entry = &table->entries[i];
+        if (!entry->latest) {
+            continue;
+        }
+        (*num_extracted)++;
+
+        int is_regular = entry->typeflag == REGTYPE || entry->typeflag == '\0' ||
+                         entry->typeflag == '7';
+        if (!is_regular || is_unsafe_name(entry->name) || entry->size > staging_size) {
+            result = flush_extract_batch(&batch);
+            if (result == 0) {
+                result = extract_member(archive, entry, &batch.method, batch.buf,
+                                        batch.buf_size);
+            }
+            continue;
+        }
+
+        if (batch.count == URING_BATCH || batch.used + entry->size > staging_size) {
+            result = flush_extract_batch(&batch);
+        }
+        batch.entries[batch.count] = entry;
+        batch.offsets[batch.count] = batch.used;
+        batch.count++;
+        // Keep each member's data aligned for the reads into staging
+        batch.used += (entry->size + COPY_BUF_ALIGN - 1) / COPY_BUF_ALIGN * COPY_BUF_ALIGN;
+    }
+    if (result == 0) {
+        result = flush_extract_batch(&batch);
+    }
+
+    free(batch.staging);
+    free(batch.buf);
+    return result;
+}
+
+// Work shared by the threads of a parallel extraction
+typedef struct {
+    in_stream_t *archive;
+    const member_table_t *table;
+    pthread_mutex_t lock;
+    // Table index of the next member to hand out
+    size_t next_index;
+    size_t num_extracted;
+    // Set once any member fails, so the other threads stop taking new ones
+    int failed;
+} extract_pool_t;
+
+/*
+ * Thread body for extract_members_parallel: repeatedly claims the next
+ * winning member that is not a directory and extracts it with a buffer and
+ * copy method of its own
+ */
+static void *extract_worker(void *arg) {
+    extract_pool_t *pool = arg;
+    size_t buf_size = minitar_options.copy_buf_size;
+    char *buf = alloc_copy_buffer(buf_size);
+    copy_method_t method = COPY_FILE_RANGE;
+
+    pthread_mutex_lock(&pool->lock);
+    if (NULL == buf) {
+        perror("Failed to allocate copy buffer");
+        pool->failed = 1;
+    }
+    while (!pool->failed && pool->next_index < pool->table->count) {
+        const member_entry_t *entry = &pool->table->entries[pool->next_index++];
+        if (!entry->latest || entry->typeflag == DIRTYPE) {
+            continue;
+        }
+        pool->num_extracted++;
+        pthread_mutex_unlock(&pool->lock);
+
+        int result = extract_member(pool->archive, entry, &method, buf, buf_size);
+
+        pthread_mutex_lock(&pool->lock);
+        if (0 != result) {
+            pool->failed = 1;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    free(buf);
+    return NULL;
+}
+
+/*
+ * Multithreaded version of extraction's second phase for uncompressed
+ * archives, used with -j. Directories are created first, in archive order,
+ * so their permissions are set just as a serial extraction would set them;
+ * the remaining winning members are then shared out among 'num_threads'
+ * threads, each copying data from the archive at the member's own offset.
+ * Every output file is written by exactly one thread, so the result is the
+ * same as extracting serially.
+ * Returns 0 on success or -1 if an error occurs
+ */
+int extract_members_parallel(in_stream_t *archive, const member_table_t *table, int num_threads,
+                             size_t *num_extracted) {
+    extract_pool_t pool = {
+        .archive = archive,
+        .table = table,
+    };
+    copy_method_t method = COPY_FILE_RANGE;
+    for (size_t i = 0; i < table->count; i++) {
+        const member_entry_t *entry = &table->entries[i];
+        if (entry->latest && entry->typeflag == DIRTYPE) {
+            (*num_extracted)++;
+            // Directories need no copy buffer
+            if (0 != extract_member(archive, entry, &method, NULL, 0)) {
+                return -1;
+            }
+        }
+    }
+
+    pthread_t *threads = calloc(num_threads, sizeof(pthread_t));
+    if (NULL == threads) {
+        perror("Failed to allocate extraction threads");
+        return -1;
+    }
+    pthread_mutex_init(&pool.lock, NULL);
+    int started = 0;
+    while (started < num_threads &&
+           0 == pthread_create(&threads[started], NULL, extract_worker, &pool)) {
+        started++;
+    }
+    if (started == 0) {
+        // Without any threads the work still gets done, just serially
+        extract_worker(&pool);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool.lock);
+    free(threads);
+
+    *num_extracted += pool.num_extracted;
+    return pool.failed ? -1 : 0;
+}
+
+/*
+ * Gives every directory extracted from 'table' the mode and mtime from its
+ * header, now that extracting the members inside it can no longer change its
+ * mtime or be refused by its mode. Goes in reverse archive order, so
+ * subdirectories are done while their parents can still be searched.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int finish_directories(const member_table_t *table) {
+    for (size_t i = table->count; i > 0; i--) {
+        const member_entry_t *entry = &table->entries[i - 1];
+        if (!entry->latest || entry->typeflag != DIRTYPE || is_unsafe_name(entry->name)) {
+            continue;
+        }
+        struct timespec times[2] = {
+            {.tv_nsec = UTIME_OMIT},
+            {.tv_sec = entry->mtime},
+        };
+        if (0 != chmod(entry->name, entry->mode & ~extract_umask) ||
+            0 != utimensat(AT_FDCWD, entry->name, times, 0)) {
+            char err_msg[MAX_MSG_LEN];
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to set attributes of directory %s",
+                     entry->name);
+            perror(err_msg);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Reports on and cleans up after extract_files_from_archive, closing
+ * 'archive' and its fd and clearing 'table'. After a successful extraction,
+ * the directories' attributes are set first.
+ * Returns 'result', or -1 if closing the archive fails
+ */
+static int finish_extract(in_stream_t *archive, member_table_t *table, size_t num_extracted,
+                          int result) {
+    if (0 == result && 0 != finish_directories(table)) {
+        result = -1;
+    }
+    if (minitar_options.verbose) {
+        fprintf(stderr, "Extracted %zu of %zu members\n", num_extracted, table->count);
+    }
+    member_table_clear(table);
+    in_stream_close(archive);
+    if (0 != close(archive->fd)) {
+        perror("Failure closing archive file");
+        return -1;
+    }
+    return result;
+}
+
+/*
+ * Clears the 'latest' flag of every member of 'table' not named in 'names',
+ * so that only the named members are extracted
+ * Returns 0 if every name was found, or -1 if any is missing from the archive
+ */
+static int select_named_members(member_table_t *table, const file_list_t *names) {
+    int num_found = 0;
+    for (size_t i = 0; i < table->count; i++) {
+        member_entry_t *entry = &table->entries[i];
+        if (entry->latest && !file_list_contains(names, entry->name)) {
+            entry->latest = 0;
+        } else if (entry->latest) {
+            num_found++;
+        }
+    }
+    if (num_found == names->num_indexed) {
+        return 0;
+    }
+
+    // Report the missing names with one hashed pass over the selected ones
+    file_list_t selected;
+    file_list_t missing;
+    file_list_init(&selected);
+    file_list_init(&missing);
+    for (size_t i = 0; i < table->count; i++) {
+        if (table->entries[i].latest && 0 != file_list_add(&selected, table->entries[i].name)) {
+            perror("Failed to add name to file list");
+            file_list_clear(&selected);
+            return -1;
+        }
+    }
+    if (file_list_missing(names, &selected, &missing) < 0) {
+        perror("Failed to find missing members");
+    }
+    for (int i = 0; i < missing.size; i++) {
+        fprintf(stderr, "Member %s not found in archive\n", missing.entries[i].name);
+    }
+    file_list_clear(&missing);
+    file_list_clear(&selected);
+    return -1;
+}
+
+int extract_files_from_archive(const char *archive_name) {
+    return extract_named_files_from_archive(archive_name, NULL);
+}
+
+int extract_named_files_from_archive(const char *archive_name, const file_list_t *names) {
+    int archive_fd = open(archive_name, O_RDONLY);
+    if (-1 == archive_fd) {
+        perror("Failed to open archive file");
+        return -1;
+    }
+    in_stream_t archive;
+    if (0 != in_stream_open(&archive, archive_fd, minitar_options.copy_buf_size)) {
+        perror("Failed to set up archive decompression");
+        close(archive_fd);
+        return -1;
+    }
+
+    // Extracted files get the header's mode less the umask, as open would give
+    extract_umask = umask(0);
+    umask(extract_umask);
+
+    // Phase 1: read only the headers to find the newest version of every name,
+    // or take the members straight from an up-to-date index
+    member_table_t table = {0};
+    member_index_t index;
+    if (open_member_index(archive_name, archive_fd, &index)) {
+        if (NULL != names) {
+            // Only the named members are read, wherever they are in the archive
+            in_stream_advise(&archive, 1);
+        }
+        int load_result = load_members_from_index(&index, names, &table);
+        member_index_close(&index);
+        if (0 != load_result) {
+            return finish_extract(&archive, &table, 0, -1);
+        }
+    } else if (0 != scan_archive_members(&archive, &table) ||
+               0 != mark_latest_versions(&table) ||
+               (NULL != names && 0 != select_named_members(&table, names))) {
+        return finish_extract(&archive, &table, 0, -1);
+    }
+
+    // Phase 2: read and write out only the winning members, in archive order
+    // unless -j spreads them over threads. A compressed archive is decoded a
+    // second time, serially, skipping over the data of other members (and,
+    // when it is seekable, over whole frames of it)
+    size_t num_extracted = 0;
+    if (minitar_options.use_io_uring && archive.compression == COMPRESS_NONE) {
+        uring_t ring;
+        static const unsigned char needed[] = {IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE};
+        if (0 == uring_init(&ring, URING_BATCH * 2)) {
+            if (uring_supports(&ring, needed, sizeof(needed))) {
+                int result = extract_members_uring(&ring, &archive, &table, &num_extracted);
+                uring_exit(&ring);
+                return finish_extract(&archive, &table, num_extracted, result);
+            }
+            uring_exit(&ring);
+        }
+        if (minitar_options.verbose) {
+            fprintf(stderr, "io_uring unavailable, using synchronous I/O\n");
+        }
+    }
+
+    if (minitar_options.num_threads > 1 && archive.compression == COMPRESS_NONE) {
+        int result = extract_members_parallel(&archive, &table, minitar_options.num_threads,
+                                              &num_extracted);
+        return finish_extract(&archive, &table, num_extracted, result);
+    }
+
+    size_t buf_size = minitar_options.copy_buf_size;
+    char *buffer = alloc_copy_buffer(buf_size);
+    if (NULL == buffer) {
+        perror("Failed to allocate copy buffer");
+        return finish_extract(&archive, &table, 0, -1);
+    }
+    copy_method_t method = COPY_FILE_RANGE;
+    int result = 0;
+    for (size_t i = 0; i < table.count && result == 0; i++) {
+        if (table.entries[i].latest) {
+            result = extract_member(&archive, &table.entries[i], &method, buffer, buf_size);
+            num_extracted++;
+        }
+    }
+    free(buffer);
+    return finish_extract(&archive, &table, num_extracted, result);
+}
+
+// Size and mtime of the latest archived version of one file named for update
+typedef struct {
+    int found;
+    size_t size;
+    time_t mtime;
+    // Nonzero if the file may have changed again in the second it was
+    // archived, which its mtime would not show
+    int racy;
+    // Hash of the member's data, if the index recorded one
+    int has_fingerprint;
+    uint64_t fingerprint;
+} archived_version_t;
+
+/*
+ * Fills 'versions', one per entry of 'files', with the latest archived
+ * version of each name: from the archive's index if it is up to date, or
+ * else from a single scan of the headers of 'archive'. Names not in the
+ * archive are left with 'found' clear. The index records which members are
+ * racy; a scan cannot tell when a member was written, so it takes those with
+ * an mtime at or after 'archive_mtime', the archive's last write, to be racy.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int find_archived_versions(const char *archive_name, in_stream_t *archive,
+                                  time_t archive_mtime, const file_list_t *files,
+                                  archived_version_t *versions) {
+    member_index_t index;
+    if (open_member_index(archive_name, archive->fd, &index)) {
+        for (int i = 0; i < files->size; i++) {
+            const index_entry_t *entry = member_index_lookup(&index, files->entries[i].name);
+            if (NULL != entry) {
+                versions[i] = (archived_version_t){1, entry->size, entry->mtime, entry->racy,
+                                                   entry->has_fingerprint, entry->fingerprint};
+            }
+        }
+        member_index_close(&index);
+        return 0;
+    }
+
+    member_table_t table = {0};
+    if (0 != scan_archive_members(archive, &table) || 0 != mark_latest_versions(&table)) {
+        member_table_clear(&table);
+        return -1;
+    }
+    for (size_t i = 0; i < table.count; i++) {
+        const member_entry_t *entry = &table.entries[i];
+        int pos = entry->latest ? file_list_find(files, entry->name) : -1;
+        if (pos != -1) {
+            versions[pos] = (archived_version_t){1, entry->size, entry->mtime,
+                                                 entry->mtime >= archive_mtime, 0, 0};
+        }
+    }
+    member_table_clear(&table);
+    return 0;
+}
+
+/*
+ * Decides whether the file 'name', described by 'stat_buf', differs from its
+ * latest archived version 'version', by hashing its data through 'buf', which
+ * holds 'buf_size' bytes, when the archived version was fingerprinted, or
+ * else by size and modification time (directories, by the latter alone). A
+ * racy version could have changed again within the second it was archived
+ * without its mtime showing it, so without a fingerprint it always counts as
+ * changed.
+ * Returns 1 if the file changed, 0 if not, or -1 if an error occurs
+ */
+static int file_changed(const char *name, const struct stat *stat_buf,
+                        const archived_version_t *version, char *buf, size_t buf_size) {
+    // Found beneath a named directory, but new to the archive
+    if (!version->found) {
+        return 1;
+    }
+    // Directories hold no data to compare, so only their mtimes are
+    if (S_ISDIR(stat_buf->st_mode)) {
+        return stat_buf->st_mtime != version->mtime || version->racy;
+    }
+    if (stat_buf->st_size != version->size) {
+        return 1;
+    }
+    if (!version->has_fingerprint) {
+        return stat_buf->st_mtime != version->mtime || version->racy;
+    }
+    uint64_t hash;
+    int fd = open_member(name);
+    if (-1 == fd || 0 != fingerprint_file(fd, buf, buf_size, &hash)) {
+        char err_msg[MAX_MSG_LEN];
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to read file %s", name);
+        perror(err_msg);
+        if (-1 != fd) {
+            close(fd);
+        }
+        return -1;
+    }
+    close(fd);
+    return hash != version->fingerprint;
+}
+
+/*
+ * Does the work of update_files_in_archive once the names given, 'named',
+ * have been expanded into 'files'. 'starts' holds the position in 'files' of
+ * each name in 'named', which must be in the archive already.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int update_members(const char *archive_name, const file_list_t *named,
+                          const file_list_t *files, const int *starts) {
+    int archive_fd = open(archive_name, O_RDONLY);
+    if (-1 == archive_fd) {
+        perror("Failed to open archive file");
+        return -1;
+    }
+    struct stat archive_stat;
+    in_stream_t archive;
+    if (0 != fstat(archive_fd, &archive_stat)) {
+        perror("Failed to stat archive file");
+        close(archive_fd);
+        return -1;
+    }
+    if (0 != in_stream_open(&archive, archive_fd, minitar_options.copy_buf_size)) {
+        perror("Failed to set up archive decompression");
+        close(archive_fd);
+        return -1;
+    }
+    archived_version_t *versions = calloc(files->size + 1, sizeof(archived_version_t));
+    int result = NULL == versions ? -1 : 0;
+    if (NULL == versions) {
+        perror("Failed to allocate update state");
+    } else {
+        result = find_archived_versions(archive_name, &archive, archive_stat.st_mtime, files,
+                                        versions);
+    }
+    in_stream_close(&archive);
+    close(archive_fd);
+
+    // Every name given must already be in the archive; otherwise nothing is
+    // changed. Files found beneath a named directory may be new
+    for (int i = 0; i < named->size && 0 == result; i++) {
+        if (!versions[file_list_find(files, files->entries[starts[i]].name)].found) {
+            fprintf(stderr,
+                    "Error: One or more of the specified files is not already present in "
+                    "archive\n");
+            result = -1;
+        }
+    }
+
+    // Only files that differ from the archived version are appended. Once
+    // any member has a fingerprint, the new members are fingerprinted too
+    char *buffer = NULL;
+    for (int i = 0; i < files->size && 0 == result; i++) {
+        if (versions[i].has_fingerprint) {
+            minitar_options.fingerprint = 1;
+        }
+    }
+    if (minitar_options.fingerprint && 0 == result &&
+        NULL == (buffer = alloc_copy_buffer(minitar_options.copy_buf_size))) {
+        perror("Failed to allocate copy buffer");
+        result = -1;
+    }
+    file_list_t changed;
+    file_list_init(&changed);
+    size_t skipped_bytes = 0;
+    for (int i = 0; i < files->size && 0 == result; i++) {
+        const char *name = files->entries[i].name;
+        int pos = file_list_find(files, name);
+        const archived_version_t *version = &versions[pos];
+        struct stat stat_buf;
+        int is_changed = 0;
+        if (pos != i) {
+            // A repeated name, already decided
+            continue;
+        } else if (0 != stat(name, &stat_buf)) {
+            char err_msg[MAX_MSG_LEN];
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to stat file %s", name);
+            perror(err_msg);
+            result = -1;
+        } else if ((is_changed = file_changed(name, &stat_buf, version, buffer,
+                                              minitar_options.copy_buf_size)) < 0) {
+            result = -1;
+        } else if (is_changed) {
+            if (0 != file_list_add(&changed, name)) {
+                perror("Failed to add name to file list");
+                result = -1;
+            }
+        } else if (!S_ISDIR(stat_buf.st_mode)) {
+            skipped_bytes += stat_buf.st_size;
+        }
+    }
+    free(buffer);
+    free(versions);
+
+    if (0 == result && minitar_options.verbose) {
+        fprintf(stderr, "Updating %d of %d files, skipped %zu bytes of unchanged files\n",
+                changed.size, files->num_indexed, skipped_bytes);
+    }
+    if (0 == result && changed.size > 0 && 0 != append_files_to_archive(archive_name, &changed)) {
+        result = -1;
+    }
+    file_list_clear(&changed);
+    return result;
+}
+
+int update_files_in_archive(const char *archive_name, const file_list_t *files) {
+    file_list_t expanded;
+    file_list_init(&expanded);
+    int *starts = calloc(files->size + 1, sizeof(int));
+    int result = -1;
+    if (NULL == starts) {
+        perror("Failed to allocate update state");
+    } else if (0 != dir_walk_expand(files, minitar_options.num_threads, &expanded, starts)) {
+        fprintf(stderr, "Failed to read directory tree\n");
+    } else {
+        result = update_members(archive_name, files, &expanded, starts);
+    }
+    free(starts);
+    file_list_clear(&expanded);
+    return result;
 }
@@ -1,7 +1,13 @@
 #ifndef _MINITAR_H
 #define _MINITAR_H
+#include "archive_stream.h"
 #include "file_list.h"
 
+#include <stddef.h>
+
+// Default number of bytes moved per read/write when copying member data (1 MiB)
+#define DEFAULT_COPY_BUF_SIZE (1 << 20)
+
 // Standard tar header layout defined by POSIX
 typedef struct {
     // File's name, as a null-terminated string
@@ -39,6 +45,48 @@ typedef struct {
     char padding[12];
 } tar_header;
 
+// Ways of moving member data into an archive, from fastest to most portable
+typedef enum {
+    COPY_FILE_RANGE,    // In-kernel copy, may share extents on reflink filesystems
+    COPY_SENDFILE,      // In-kernel copy through the page cache
+    COPY_READ_WRITE,    // Plain read/write loop through a userspace buffer
+} copy_method_t;
+
+// Settings shared by all archive operations, filled in from the command line
+typedef struct {
+    // Bytes moved per read/write when copying member data, a multiple of 512
+    size_t copy_buf_size;
+    // When nonzero, print statistics about each operation to stderr
+    int verbose;
+    // When nonzero, store only numeric owner and group IDs in headers,
+    // skipping the user and group name lookups
+    int numeric_owner;
+    // Number of threads reading members ahead of the archive writer (-j)
+    int num_threads;
+    // When nonzero, batch file I/O through io_uring if the kernel allows it
+    int use_io_uring;
+    // Compression applied to archives being created (-z, --zstd)
+    compression_t compression;
+    // Compressor level, or 0 for the compressor's default (--level)
+    int compression_level;
+    // When nonzero, compressed archives are written as independently
+    // compressed frames followed by a frame table (--seekable)
+    int seekable;
+    // When nonzero, create and append write a member index next to the
+    // archive (--index). Append keeps an existing index up to date regardless
+    int use_index;
+    // When nonzero, append commits new members with a single header write
+    // after they are on disk, trimming any torn tail left by an earlier
+    // interrupted append first (--durable)
+    int durable;
+    // When nonzero, create and append hash each member's data as it is
+    // copied and record the hashes in the member index, and update compares
+    // files by content rather than by modification time (--fingerprint)
+    int fingerprint;
+} minitar_options_t;
+
+extern minitar_options_t minitar_options;
+
 /*
  * Create a new archive file with the name 'archive_name'.
  * The archive should contain all files stored in the 'files' list.
@@ -58,6 +106,18 @@ int create_archive(const char *archive_name, const file_list_t *files);
  */
 int append_files_to_archive(const char *archive_name, const file_list_t *files);
 
+/*
+ * Update the archive with the name 'archive_name' with the files in 'files',
+ * every one of which must already be a member of the archive. Directories in
+ * 'files' stand for everything beneath them, and files found there that are
+ * not yet in the archive are appended. Only files whose size or modification
+ * time differs from their latest archived version are appended; the rest are
+ * skipped. Members whose data was fingerprinted are compared by size and
+ * content hash instead.
+ * This function should return 0 upon success or -1 if an error occurred.
+ */
+int update_files_in_archive(const char *archive_name, const file_list_t *files);
+
 /*
  * Add the name of each file contained in the archive identified by 'archive_name'
  * to the 'files' list.
@@ -77,4 +137,12 @@ int get_archive_file_list(const char *archive_name, file_list_t *files);
  */
 int extract_files_from_archive(const char *archive_name);
 
+/*
+ * Like extract_files_from_archive, but writes out only the latest version of
+ * each member named in 'names'. Every name must be present in the archive.
+ * Seekable compressed archives are only decompressed where needed.
+ * Returns 0 upon success or -1 if an error occurred.
+ */
+int extract_named_files_from_archive(const char *archive_name, const file_list_t *names);
+
 #endif    // _MINITAR_H
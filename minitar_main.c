@@ -1,32 +1,150 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "dir_walk.h"
 #include "file_list.h"
 #include "minitar.h"
 
+// Upper bound on -j, far more than storage devices can make use of
+#define MAX_THREADS 256
+// Highest compression level accepted by any supported compressor (zstd's)
+#define MAX_COMPRESSION_LEVEL 22
+
+#define USAGE                                                                   \
+    "Usage: %s -c|a|t|u|x [OPTION...] -f ARCHIVE [FILE...]\n"                   \
+    "Options:\n"                                                                \
+    "  -v               Print statistics about the operation to stderr\n"       \
+    "  -b SIZE          Copy member data SIZE bytes at a time (K/M suffixes)\n" \
+    "  -j N             Read ahead, compress or extract on N threads\n"         \
+    "  --numeric-owner  Store only numeric owner and group IDs\n"               \
+    "  --io-uring       Batch file I/O through io_uring when available\n"       \
+    "  -z               Compress a new archive with gzip\n"                     \
+    "  --zstd           Compress a new archive with zstd\n"                     \
+    "  --level N        Compression level (gzip 1-9, zstd 1-22)\n"              \
+    "  --seekable       Compress in indexed frames for random access\n"         \
+    "  --index          Keep a member index in ARCHIVE.idx for fast lookups\n"  \
+    "  --durable        Make appends crash-safe, repairing interrupted ones\n"  \
+    "  --fingerprint    Hash member data into the index; -u compares hashes\n"  \
+    "Directories are archived with everything beneath them.\n"                  \
+    "Compressed archives are detected automatically when reading.\n"
+
+/*
+ * Parses a buffer size such as "4096", "512K" or "8M" into 'size', rounding
+ * it up to a whole number of 512-byte tar blocks.
+ * Returns 0 on success or -1 if the string is not a valid size
+ */
+int parse_buf_size(const char *str, size_t *size) {
+    char *end;
+    unsigned long long value = strtoull(str, &end, 10);
+    if (end == str) {
+        return -1;
+    }
+    if (*end == 'K' || *end == 'k') {
+        value <<= 10;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        value <<= 20;
+        end++;
+    }
+    // Cap at 1 GiB, well beyond the point where larger copies stop helping
+    if (*end != '\0' || value == 0 || value > (1ULL << 30)) {
+        return -1;
+    }
+    *size = (value + 511) / 512 * 512;
+    return 0;
+}
+
 int main(int argc, char **argv) {
     if (argc < 4) {
-        printf("Usage: %s -c|a|t|u|x -f ARCHIVE [FILE...]\n", argv[0]);
+        printf(USAGE, argv[0]);
         return 0;
     }
 
     file_list_t files;
     file_list_init(&files);
 
-    // TODO: Parse command-line arguments and invoke functions from 'minitar.h'
-    // to execute archive operations
-
     char *operation = argv[1];
-    if (strcmp(argv[2], "-f") != 0) {
+
+    // Optional flags sit between the operation and '-f'
+    int arg = 2;
+    while (arg < argc && strcmp(argv[arg], "-f") != 0) {
+        if (strcmp(argv[arg], "-v") == 0) {
+            minitar_options.verbose = 1;
+        } else if (strcmp(argv[arg], "-j") == 0 && arg + 1 < argc) {
+            arg++;
+            char *end;
+            long num_threads = strtol(argv[arg], &end, 10);
+            if (end == argv[arg] || *end != '\0' || num_threads < 1 ||
+                num_threads > MAX_THREADS) {
+                fprintf(stderr, "Invalid thread count %s\n", argv[arg]);
+                return 1;
+            }
+            minitar_options.num_threads = num_threads;
+        } else if (strcmp(argv[arg], "--io-uring") == 0) {
+            minitar_options.use_io_uring = 1;
+        } else if (strcmp(argv[arg], "-z") == 0) {
+            minitar_options.compression = COMPRESS_GZIP;
+        } else if (strcmp(argv[arg], "--zstd") == 0) {
+            minitar_options.compression = COMPRESS_ZSTD;
+        } else if (strcmp(argv[arg], "--index") == 0) {
+            minitar_options.use_index = 1;
+        } else if (strcmp(argv[arg], "--fingerprint") == 0) {
+            // Fingerprints are kept in the member index
+            minitar_options.fingerprint = 1;
+            minitar_options.use_index = 1;
+        } else if (strcmp(argv[arg], "--durable") == 0) {
+            minitar_options.durable = 1;
+        } else if (strcmp(argv[arg], "--seekable") == 0) {
+            minitar_options.seekable = 1;
+        } else if (strcmp(argv[arg], "--level") == 0 && arg + 1 < argc) {
+            arg++;
+            char *end;
+            long level = strtol(argv[arg], &end, 10);
+            if (end == argv[arg] || *end != '\0' || level < 1 || level > MAX_COMPRESSION_LEVEL) {
+                fprintf(stderr, "Invalid compression level %s\n", argv[arg]);
+                return 1;
+            }
+            minitar_options.compression_level = level;
+        } else if (strcmp(argv[arg], "--numeric-owner") == 0) {
+            minitar_options.numeric_owner = 1;
+        } else if (strcmp(argv[arg], "-b") == 0 && arg + 1 < argc) {
+            arg++;
+            if (parse_buf_size(argv[arg], &minitar_options.copy_buf_size) != 0) {
+                fprintf(stderr, "Invalid buffer size %s\n", argv[arg]);
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "Unrecognized option %s\n", argv[arg]);
+            return 1;
+        }
+        arg++;
+    }
+    if (arg + 1 >= argc) {
         fprintf(stderr, "Expected -f flag\n");
         return 1;
     }
-    char *archive_name = argv[3];
+    char *archive_name = argv[arg + 1];
 
-    for (int i = 4; i < argc; i++) {
+    for (int i = arg + 2; i < argc; i++) {
         file_list_add(&files, argv[i]);
     }
 
+    // Directories given to create or append stand for their whole tree;
+    // update expands them itself, as it treats named files differently
+    if (strcmp(operation, "-c") == 0 || strcmp(operation, "-a") == 0) {
+        file_list_t expanded;
+        file_list_init(&expanded);
+        if (0 != dir_walk_expand(&files, minitar_options.num_threads, &expanded, NULL)) {
+            fprintf(stderr, "Failed to read directory tree\n");
+            file_list_clear(&expanded);
+            file_list_clear(&files);
+            return 1;
+        }
+        file_list_clear(&files);
+        files = expanded;
+    }
+
     if (strcmp(operation, "-c") == 0) {
         int create_archive_result = create_archive(archive_name, &files);
         if (0 != create_archive_result) {
@@ -41,14 +159,53 @@ int main(int argc, char **argv) {
         }
 
     } else if (strcmp(operation, "-t") == 0) {
-        // call get_archive_file_list then print the list out here
+        // Members are listed into their own list; any FILE operands only
+        // select which of them are printed
+        file_list_t members;
+        file_list_init(&members);
+        if (get_archive_file_list(archive_name, &members) != 0) {
+            fprintf(stderr, "Failed to list archive\n");
+            file_list_clear(&members);
+            file_list_clear(&files);
+            return 1;
+        }
+        for (int i = 0; i < members.size; i++) {
+            if (files.size == 0 || file_list_contains(&files, members.entries[i].name)) {
+                printf("%s\n", members.entries[i].name);
+            }
+        }
+        int num_missing = 0;
+        for (int i = 0; i < files.size; i++) {
+            if (file_list_find(&files, files.entries[i].name) == i &&
+                !file_list_contains(&members, files.entries[i].name)) {
+                fprintf(stderr, "Member %s not found in archive\n", files.entries[i].name);
+                num_missing++;
+            }
+        }
+        file_list_clear(&members);
+        if (num_missing > 0) {
+            file_list_clear(&files);
+            return 1;
+        }
     } else if (strcmp(operation, "-u") == 0) {
-        // check if file is contained in archive file, then call
-        // append_files_to_archive
+        if (update_files_in_archive(archive_name, &files) != 0) {
+            file_list_clear(&files);
+            return 1;
+        }
     } else if (strcmp(operation, "-x") == 0) {
-        extract_files_from_archive(archive_name);
+        int extract_result;
+        if (files.size > 0) {
+            extract_result = extract_named_files_from_archive(archive_name, &files);
+        } else {
+            extract_result = extract_files_from_archive(archive_name);
+        }
+        if (extract_result != 0) {
+            fprintf(stderr, "Failed to extract from archive\n");
+            file_list_clear(&files);
+            return 1;
+        }
     } else {
-        printf("Usage: %s -c|a|t|u|x -f ARCHIVE [FILE...]\n", argv[0]);
+        printf(USAGE, argv[0]);
         return 0;
     }
 
@@ -0,0 +1,66 @@
+#include "octal.h"
+
+#include <string.h>
+
+// Every pair of octal digits, so each table lookup converts six bits
+static const char OCTAL_PAIRS[128] = "00010203040506071011121314151617"
+                                     "20212223242526273031323334353637"
+                                     "40414243444546475051525354555657"
+                                     "60616263646566677071727374757677";
+
+// Value of each octal digit character, or 0xff for every other byte
+static const unsigned char OCTAL_VALUES[256] = {
+    [0 ... 255] = 0xff,
+    ['0'] = 0, ['1'] = 1, ['2'] = 2, ['3'] = 3, ['4'] = 4, ['5'] = 5, ['6'] = 6, ['7'] = 7,
+};
+
+int encode_numeric(char *field, size_t len, unsigned long long value) {
+    size_t digits = len - 1;
+    if (digits * 3 >= 64 || value >> (digits * 3) == 0) {
+        field[digits] = '\0';
+        size_t pos = digits;
+        for (; pos >= 2; pos -= 2) {
+            memcpy(field + pos - 2, OCTAL_PAIRS + 2 * (value & 63), 2);
+            value >>= 6;
+        }
+        if (pos == 1) {
+            field[0] = '0' + (value & 7);
+        }
+        return 0;
+    }
+
+    // Base-256 leaves one byte for the marker
+    if (digits * 8 < 64 && value >> (digits * 8) != 0) {
+        return -1;
+    }
+    field[0] = (char) 0x80;
+    for (size_t i = len - 1; i >= 1; i--) {
+        field[i] = value & 0xff;
+        value >>= 8;
+    }
+    return 0;
+}
+
+unsigned long long decode_numeric(const char *field, size_t len) {
+    const unsigned char *bytes = (const unsigned char *) field;
+    unsigned long long value = 0;
+    if (len > 0 && bytes[0] == 0x80) {
+        for (size_t i = 1; i < len; i++) {
+            value = (value << 8) | bytes[i];
+        }
+        return value;
+    }
+
+    size_t i = 0;
+    while (i < len && bytes[i] == ' ') {
+        i++;
+    }
+    for (; i < len; i++) {
+        unsigned char digit = OCTAL_VALUES[bytes[i]];
+        if (digit == 0xff) {
+            break;
+        }
+        value = (value << 3) | digit;
+    }
+    return value;
+}
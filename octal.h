@@ -0,0 +1,22 @@
+#ifndef _OCTAL_H
+#define _OCTAL_H
+
+#include <stddef.h>
+
+/*
+ * Stores 'value' in the 'len'-byte numeric header field 'field' as len - 1
+ * 0-padded octal digits and a null byte, the same text as "%0*o". Values
+ * with too many digits are stored in GNU tar's base-256 form instead: a
+ * first byte of 0x80 followed by the value in big-endian binary.
+ * Returns 0 on success or -1 if the value does not fit either way
+ */
+int encode_numeric(char *field, size_t len, unsigned long long value);
+
+/*
+ * Parses the 'len'-byte numeric header field 'field', in either form written
+ * by encode_numeric. Octal fields may start with spaces, and parsing stops at
+ * the first byte that is not an octal digit.
+ */
+unsigned long long decode_numeric(const char *field, size_t len);
+
+#endif    // _OCTAL_H
@@ -0,0 +1,193 @@
+#define _GNU_SOURCE
+#include "uring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+int uring_init(uring_t *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(uring_t));
+
+    ring->ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->ring_fd < 0) {
+        return -1;
+    }
+
+    ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    // Newer kernels map both rings with a single mmap
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_len > ring->sq_len) {
+            ring->sq_len = ring->cq_len;
+        }
+        ring->cq_len = 0;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->ring_fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        close(ring->ring_fd);
+        return -1;
+    }
+    ring->cq_ptr = ring->sq_ptr;
+    if (ring->cq_len > 0) {
+        ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            munmap(ring->sq_ptr, ring->sq_len);
+            close(ring->ring_fd);
+            return -1;
+        }
+    }
+
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->ring_fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cq_len > 0) {
+            munmap(ring->cq_ptr, ring->cq_len);
+        }
+        munmap(ring->sq_ptr, ring->sq_len);
+        close(ring->ring_fd);
+        return -1;
+    }
+
+    char *sq = ring->sq_ptr;
+    ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+
+    char *cq = ring->cq_ptr;
+    ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    return 0;
+}
+
+void uring_exit(uring_t *ring) {
+    munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_len > 0) {
+        munmap(ring->cq_ptr, ring->cq_len);
+    }
+    munmap(ring->sq_ptr, ring->sq_len);
+    close(ring->ring_fd);
+}
+
+int uring_supports(uring_t *ring, const unsigned char *opcodes, int count) {
+    size_t probe_len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probe_len);
+    if (NULL == probe) {
+        return 0;
+    }
+    // Kernels too old to answer the probe (before 5.6) also lack openat and
+    // statx, so a failed probe means the ring cannot be used
+    int supported = 0;
+    if (0 == syscall(__NR_io_uring_register, ring->ring_fd, IORING_REGISTER_PROBE, probe, 256)) {
+        supported = 1;
+        for (int i = 0; i < count; i++) {
+            if (opcodes[i] > probe->last_op ||
+                !(probe->ops[opcodes[i]].flags & IO_URING_OP_SUPPORTED)) {
+                supported = 0;
+            }
+        }
+    }
+    free(probe);
+    return supported;
+}
+
+struct io_uring_sqe *uring_get_sqe(uring_t *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail + ring->sq_queued;
+    if (tail - head >= ring->sq_entries) {
+        return NULL;
+    }
+    unsigned index = tail & *ring->sq_mask;
+    ring->sq_array[index] = index;
+    ring->sq_queued++;
+    memset(&ring->sqes[index], 0, sizeof(struct io_uring_sqe));
+    return &ring->sqes[index];
+}
+
+int uring_run(uring_t *ring, int *results, unsigned num_results) {
+    unsigned num_pending = ring->sq_queued;
+    unsigned num_unsubmitted = num_pending;
+    // Publish the new entries to the kernel before entering
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + num_pending, __ATOMIC_RELEASE);
+    ring->sq_queued = 0;
+
+    unsigned completed = 0;
+    while (completed < num_pending) {
+        int submitted = syscall(__NR_io_uring_enter, ring->ring_fd, num_unsubmitted, 1,
+                                IORING_ENTER_GETEVENTS, NULL, 0);
+        if (submitted < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        num_unsubmitted -= submitted;
+
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            if (cqe->user_data < num_results) {
+                results[cqe->user_data] = cqe->res;
+            }
+            completed++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+void uring_prep_openat(struct io_uring_sqe *sqe, int dir_fd, const char *path, int flags,
+                       mode_t mode) {
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = dir_fd;
+    sqe->addr = (unsigned long) path;
+    sqe->len = mode;
+    sqe->open_flags = flags;
+}
+
+void uring_prep_statx(struct io_uring_sqe *sqe, int fd, const char *path, int flags,
+                      unsigned mask, struct statx *statx_buf) {
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) path;
+    sqe->len = mask;
+    sqe->off = (unsigned long) statx_buf;
+    sqe->statx_flags = flags;
+}
+
+void uring_prep_read(struct io_uring_sqe *sqe, int fd, void *buf, unsigned len, off_t offset) {
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) buf;
+    sqe->len = len;
+    sqe->off = offset;
+}
+
+void uring_prep_write(struct io_uring_sqe *sqe, int fd, const void *buf, unsigned len,
+                      off_t offset) {
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) buf;
+    sqe->len = len;
+    sqe->off = offset;
+}
+
+void uring_prep_close(struct io_uring_sqe *sqe, int fd) {
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+}
@@ -0,0 +1,66 @@
+#ifndef _URING_H
+#define _URING_H
+
+#include <linux/io_uring.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// Minimal io_uring wrapper built directly on the kernel interface, so minitar
+// does not need liburing. Only what the batch engines in minitar.c use is here.
+typedef struct {
+    int ring_fd;
+    // Submission queue ring, shared with the kernel
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_entries;
+    // Number of entries queued with uring_get_sqe but not yet submitted
+    unsigned sq_queued;
+    // Completion queue ring, shared with the kernel
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    // Mappings to undo in uring_exit
+    void *sq_ptr;
+    size_t sq_len;
+    void *cq_ptr;
+    size_t cq_len;
+    size_t sqes_len;
+} uring_t;
+
+// Set up a ring with room for 'entries' submissions in flight
+// Returns 0 on success, or -1 if io_uring is unavailable or an error occurs
+int uring_init(uring_t *ring, unsigned entries);
+
+// Tear down a ring set up by uring_init
+void uring_exit(uring_t *ring);
+
+// Ask the kernel whether it implements every one of the 'count' operations
+// in 'opcodes' (IORING_OP_*)
+// Returns 1 if all of them are supported, or 0 if any is not or the kernel
+// cannot say
+int uring_supports(uring_t *ring, const unsigned char *opcodes, int count);
+
+// Get a zeroed submission entry to fill in, or NULL if the queue is full
+struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+
+// Submit every queued entry and wait until all of them complete. The result
+// of the entry whose user_data is i is stored in results[i], so user_data
+// must be below 'num_results'
+// Returns 0 on success or -1 if submitting fails
+int uring_run(uring_t *ring, int *results, unsigned num_results);
+
+// Helpers that fill in an entry for one operation, like liburing's io_uring_prep_*
+void uring_prep_openat(struct io_uring_sqe *sqe, int dir_fd, const char *path, int flags,
+                       mode_t mode);
+void uring_prep_statx(struct io_uring_sqe *sqe, int fd, const char *path, int flags,
+                      unsigned mask, struct statx *statx_buf);
+void uring_prep_read(struct io_uring_sqe *sqe, int fd, void *buf, unsigned len, off_t offset);
+void uring_prep_write(struct io_uring_sqe *sqe, int fd, const void *buf, unsigned len,
+                      off_t offset);
+void uring_prep_close(struct io_uring_sqe *sqe, int fd);
+
+#endif    // _URING_H